@@ -27,26 +27,30 @@
  *      in aesd_buffer.
  * @return the struct aesd_buffer_entry structure representing the position described by char_offset, or
  * NULL if this position is not available in the buffer (not enough data is written).
+ * The entry is found with a binary search over the entry offsets.
  */
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn )
 {
-    uint8_t current = buffer->out_offs;
-    bool valid_full = buffer->full;
-    size_t count = char_offset;
-
-    while (current != buffer->in_offs || valid_full) {
-        if (buffer->entry[current].size > count) {
-            *entry_offset_byte_rtn = count;
-            return &(buffer->entry[current]);
-        } else {
-            count -= buffer->entry[current].size;
-            current = (current + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-            valid_full = false;
-            continue;
-        }
+    struct aesd_buffer_entry *entry;
+    uint32_t low = 0;
+    uint32_t high = buffer->count;
+
+    if (char_offset >= buffer->total_size)
+        return NULL;
+
+    // Find the last entry starting at or before char_offset. It can't be
+    // empty: the next entry starts after char_offset or there is none.
+    while (high - low > 1) {
+        uint32_t mid = low + (high - low) / 2;
+        if (aesd_circular_buffer_entry_fpos(buffer, aesd_circular_buffer_entry_at(buffer, mid)) <= char_offset)
+            low = mid;
+        else
+            high = mid;
     }
-    return NULL;
+    entry = aesd_circular_buffer_entry_at(buffer, low);
+    *entry_offset_byte_rtn = char_offset - aesd_circular_buffer_entry_fpos(buffer, entry);
+    return entry;
 }
 
 /**
@@ -55,22 +59,106 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct
 * new start location.
 * Any necessary locking must be handled by the caller
 * Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime managed by the caller.
+* @return the buffptr of the overwritten entry, or NULL if nothing was overwritten
 */
-void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
+const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
 {
+    const char *overwritten = NULL;
+    struct aesd_buffer_entry removed;
+
+    if (buffer->full && aesd_circular_buffer_pop_entry(buffer, &removed))
+        overwritten = removed.buffptr;
+
     buffer->entry[buffer->in_offs] = *add_entry;
-    buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-    if (buffer->full) {
-        buffer->out_offs = buffer->in_offs;
+    buffer->entry[buffer->in_offs].offset = buffer->end_offset;
+    buffer->end_offset += add_entry->size;
+    if (++buffer->in_offs == buffer->capacity)
+        buffer->in_offs = 0;
+    buffer->count++;
+    buffer->total_size += add_entry->size;
+    buffer->full = buffer->count == buffer->capacity;
+    return overwritten;
+}
+
+/**
+* @return true if the oldest entry has to be removed before adding an entry of @param add_size bytes,
+* because @param buffer is full or adding it would exceed the optional byte budget. The newest entry
+* is always kept, even when it alone exceeds the budget.
+*/
+bool aesd_circular_buffer_needs_evict(struct aesd_circular_buffer *buffer, size_t add_size)
+{
+    if (buffer->full)
+        return true;
+    return buffer->max_bytes && buffer->count &&
+        buffer->total_size + add_size > buffer->max_bytes;
+}
+
+/**
+* Removes the oldest entry of @param buffer, storing it in @param removed so the caller can free it.
+* Any necessary locking must be handled by the caller
+* @return false if the buffer was empty
+*/
+bool aesd_circular_buffer_pop_entry(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *removed)
+{
+    if (!buffer->count)
+        return false;
+
+    *removed = buffer->entry[buffer->out_offs];
+    memset(&buffer->entry[buffer->out_offs], 0, sizeof(struct aesd_buffer_entry));
+    if (++buffer->out_offs == buffer->capacity)
+        buffer->out_offs = 0;
+    buffer->count--;
+    buffer->total_size -= removed->size;
+    buffer->full = false;
+    return true;
+}
+
+/**
+* Moves the entries of @param buffer to @param storage, an array of @param capacity entries, and
+* changes the number of retained entries to capacity.
+* @param storage may be NULL to use the storage embedded in the buffer, for a capacity of at most
+* AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED.
+* storage must not be the array currently in use, and capacity must be at least the number of
+* entries currently stored: evict with aesd_circular_buffer_pop_entry() first.
+* Any necessary locking must be handled by the caller
+* @return the previous storage for the caller to free, or NULL if it was the embedded storage
+*/
+struct aesd_buffer_entry *aesd_circular_buffer_set_storage(struct aesd_circular_buffer *buffer,
+            struct aesd_buffer_entry *storage, uint32_t capacity)
+{
+    struct aesd_buffer_entry moved[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    struct aesd_buffer_entry *prev = buffer->entry;
+    uint32_t i;
+
+    if (!storage)
+        storage = buffer->default_entry;
+
+    if (storage == buffer->default_entry) {
+        // The entries may occupy the embedded storage already, gather them first
+        for (i = 0; i < buffer->count; i++)
+            moved[i] = *aesd_circular_buffer_entry_at(buffer, i);
+        memcpy(storage, moved, buffer->count * sizeof(struct aesd_buffer_entry));
     } else {
-        buffer->full = buffer->in_offs == buffer->out_offs;
+        for (i = 0; i < buffer->count; i++)
+            storage[i] = *aesd_circular_buffer_entry_at(buffer, i);
     }
+    memset(&storage[buffer->count], 0, (capacity - buffer->count) * sizeof(struct aesd_buffer_entry));
+
+    buffer->entry = storage;
+    buffer->capacity = capacity;
+    buffer->out_offs = 0;
+    buffer->full = buffer->count == buffer->capacity;
+    buffer->in_offs = buffer->full ? 0 : buffer->count;
+    return prev == buffer->default_entry ? NULL : prev;
 }
 
 /**
 * Initializes the circular buffer described by @param buffer to an empty struct
+* holding up to AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries
 */
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    buffer->entry = buffer->default_entry;
+    buffer->capacity = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
 }
@@ -14,8 +14,13 @@
 #include <stddef.h> // size_t
 #include <stdint.h> // uintx_t
 #include <stdbool.h>
+#include <stdatomic.h>
 #endif
 
+/**
+ * Default number of writes remembered by a circular buffer, and the number of
+ * entry slots embedded in it. Larger capacities use caller allocated storage.
+ */
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
 
 struct aesd_buffer_entry
@@ -28,44 +33,108 @@ struct aesd_buffer_entry
      * Number of bytes stored in buffptr
      */
     size_t size;
+    /**
+     * Position of the first byte of buffptr among all bytes ever added to the
+     * buffer, set by aesd_circular_buffer_add_entry()
+     */
+    size_t offset;
 };
 
 struct aesd_circular_buffer
 {
     /**
-     * An array of pointers to memory allocated for the most recent write operations
+     * Entry slots for the most recent write operations, capacity of them.
+     * Points at default_entry unless set with aesd_circular_buffer_set_storage()
      */
-    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    struct aesd_buffer_entry *entry;
+    /**
+     * Maximum number of entries retained, also the number of slots: slot
+     * indexes wrap back to 0 at capacity, so in_offs == out_offs once full
+     */
+    uint32_t capacity;
     /**
      * The current location in the entry structure where the next write should
      * be stored.
      */
-    uint8_t in_offs;
+    uint32_t in_offs;
     /**
      * The first location in the entry structure to read from
      */
-    uint8_t out_offs;
+    uint32_t out_offs;
+    /**
+     * Number of entries currently stored
+     */
+    uint32_t count;
     /**
-     * set to true when the buffer entry structure is full
+     * set to true when the buffer holds capacity entries
      */
     bool full;
+    /**
+     * Sum of the sizes of the stored entries
+     */
+    size_t total_size;
+    /**
+     * Position just past the newest entry among all bytes ever added, the
+     * oldest entry starts at end_offset - total_size
+     */
+    size_t end_offset;
+    /**
+     * Optional byte budget checked by aesd_circular_buffer_needs_evict(), 0 for none
+     */
+    size_t max_bytes;
+    /**
+     * Storage used for the default capacity
+     */
+    struct aesd_buffer_entry default_entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
 };
 
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn );
 
-extern void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
+extern const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
+
+extern bool aesd_circular_buffer_needs_evict(struct aesd_circular_buffer *buffer, size_t add_size);
+
+extern bool aesd_circular_buffer_pop_entry(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *removed);
+
+extern struct aesd_buffer_entry *aesd_circular_buffer_set_storage(struct aesd_circular_buffer *buffer,
+            struct aesd_buffer_entry *storage, uint32_t capacity);
 
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+/**
+ * @return the entry written @param index writes after the oldest one still stored in @param buffer,
+ * or NULL if there are not that many entries.
+ */
+static inline struct aesd_buffer_entry *aesd_circular_buffer_entry_at(struct aesd_circular_buffer *buffer,
+            uint32_t index)
+{
+    if (index >= buffer->count)
+        return NULL;
+    index += buffer->out_offs;
+    if (index >= buffer->capacity)
+        index -= buffer->capacity;
+    return &buffer->entry[index];
+}
+
+/**
+ * @return the position of the first byte of @param entry, stored in @param buffer, if all
+ * entries were concatenated end to end
+ */
+static inline size_t aesd_circular_buffer_entry_fpos(const struct aesd_circular_buffer *buffer,
+            const struct aesd_buffer_entry *entry)
+{
+    return entry->offset - (buffer->end_offset - buffer->total_size);
+}
+
 /**
  * Create a for loop to iterate over each member of the circular buffer.
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a uint32_t stack allocated value used by this macro for an index
  * Example usage:
- * uint8_t index;
+ * uint32_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -74,9 +143,146 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
     for(index=0, entryptr=&((buffer)->entry[index]); \
-            index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
+            index<(buffer)->capacity; \
             index++, entryptr=&((buffer)->entry[index]))
 
 
+#ifndef __KERNEL__
+
+/**
+ * Lock free variant of struct aesd_circular_buffer for user space, handing
+ * entries from producer threads to a single consumer thread without a mutex.
+ * Unlike the locked buffer it never overwrites: adding to a full buffer fails
+ * and the producer has to retry once the consumer caught up. Entry offsets
+ * are not assigned, the offset member is passed through unchanged.
+ *
+ * Every slot carries a sequence number telling whose turn it is: slot i is
+ * free for the write with position p when seq == p and holds the entry of
+ * that write when seq == p + 1. Producers and the consumer only synchronize
+ * through these, with release stores after filling or emptying a slot and
+ * acquire loads before using it. In single producer mode the producer owns
+ * in_offs outright, with several producers they claim positions with a
+ * compare and swap on it.
+ */
+#define AESD_CACHELINE_SIZE 64
+
+struct aesd_lockfree_slot
+{
+    _Atomic uint32_t seq;
+    struct aesd_buffer_entry entry;
+};
+
+struct aesd_lockfree_buffer
+{
+    /**
+     * Caller allocated slots, mask + 1 of them
+     */
+    struct aesd_lockfree_slot *slot;
+    /**
+     * Number of slots minus one, slot indexes wrap with index & mask
+     */
+    uint32_t mask;
+    /**
+     * Set when several threads may add entries concurrently
+     */
+    bool multi_producer;
+    /**
+     * Position of the next write, only touched by producers. On its own cache
+     * line so producers and the consumer don't invalidate each other's.
+     */
+    _Alignas(AESD_CACHELINE_SIZE) _Atomic uint32_t in_offs;
+    /**
+     * Position of the next read, only touched by the consumer
+     */
+    _Alignas(AESD_CACHELINE_SIZE) _Atomic uint32_t out_offs;
+};
+
+/**
+ * Initializes @param buffer to an empty buffer using the @param slots entries at @param storage,
+ * slots being a power of two. Set @param multi_producer when more than one thread adds entries.
+ * A heap allocated buffer should come from aligned_alloc(AESD_CACHELINE_SIZE, ...).
+ */
+static inline void aesd_lockfree_buffer_init(struct aesd_lockfree_buffer *buffer,
+            struct aesd_lockfree_slot *storage, uint32_t slots, bool multi_producer)
+{
+    uint32_t i;
+
+    buffer->slot = storage;
+    buffer->mask = slots - 1;
+    buffer->multi_producer = multi_producer;
+    for (i = 0; i < slots; i++)
+        atomic_init(&storage[i].seq, i);
+    atomic_init(&buffer->in_offs, 0);
+    atomic_init(&buffer->out_offs, 0);
+}
+
+/**
+ * Adds a copy of @param add_entry to @param buffer. Called by producers only.
+ * @return false if the buffer is full
+ */
+static inline bool aesd_lockfree_buffer_add_entry(struct aesd_lockfree_buffer *buffer,
+            const struct aesd_buffer_entry *add_entry)
+{
+    uint32_t pos = atomic_load_explicit(&buffer->in_offs, memory_order_relaxed);
+    struct aesd_lockfree_slot *slot;
+
+    for (;;) {
+        uint32_t seq;
+        int32_t diff;
+
+        slot = &buffer->slot[pos & buffer->mask];
+        seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        diff = (int32_t)(seq - pos);
+        if (diff < 0)
+            return false; // Still holds the entry from mask + 1 writes ago
+        if (!buffer->multi_producer) {
+            atomic_store_explicit(&buffer->in_offs, pos + 1, memory_order_relaxed);
+            break;
+        }
+        // A failed exchange loads the current position into pos. A slot
+        // already filled past pos means another producer took it meanwhile.
+        if (diff == 0 &&
+            atomic_compare_exchange_weak_explicit(&buffer->in_offs, &pos, pos + 1,
+                                                  memory_order_relaxed, memory_order_relaxed))
+            break;
+        if (diff > 0)
+            pos = atomic_load_explicit(&buffer->in_offs, memory_order_relaxed);
+    }
+    slot->entry = *add_entry;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    return true;
+}
+
+/**
+ * Removes the oldest entry of @param buffer, storing it in @param removed.
+ * Called by the consumer only.
+ * @return false if the buffer was empty
+ */
+static inline bool aesd_lockfree_buffer_pop_entry(struct aesd_lockfree_buffer *buffer,
+            struct aesd_buffer_entry *removed)
+{
+    uint32_t pos = atomic_load_explicit(&buffer->out_offs, memory_order_relaxed);
+    struct aesd_lockfree_slot *slot = &buffer->slot[pos & buffer->mask];
+
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos + 1)
+        return false;
+    *removed = slot->entry;
+    // Free for the write mask + 1 positions later
+    atomic_store_explicit(&slot->seq, pos + buffer->mask + 1, memory_order_release);
+    atomic_store_explicit(&buffer->out_offs, pos + 1, memory_order_relaxed);
+    return true;
+}
+
+/**
+ * @return the number of entries in @param buffer, only exact when no thread is adding or
+ * removing entries
+ */
+static inline uint32_t aesd_lockfree_buffer_count(struct aesd_lockfree_buffer *buffer)
+{
+    return atomic_load_explicit(&buffer->in_offs, memory_order_relaxed) -
+        atomic_load_explicit(&buffer->out_offs, memory_order_relaxed);
+}
+
+#endif /* __KERNEL__ */
 
 #endif /* AESD_CIRCULAR_BUFFER_H */
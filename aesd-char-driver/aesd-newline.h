@@ -0,0 +1,168 @@
+/*
+ * aesd-newline.h
+ *
+ * Newline scanning shared by the aesdchar driver and aesdsocket. Buffers are
+ * searched a block at a time: 32 bytes with AVX2 or 16 bytes with SSE2 in user
+ * space, and one machine word at a time in the kernel and on other
+ * architectures. Every newline in a block is found from a single compare, so
+ * splitting a buffer into lines touches each byte once.
+ */
+
+#ifndef AESD_NEWLINE_H
+#define AESD_NEWLINE_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/string.h>
+#else
+#include <stddef.h> // size_t
+#include <stdint.h> // uintx_t
+#include <string.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#endif
+
+#if !defined(__KERNEL__) && defined(__AVX2__)
+
+#define AESD_NEWLINE_BLOCK 32
+#define AESD_NEWLINE_SHIFT 0
+typedef uint32_t aesd_newline_mask_t;
+
+static inline aesd_newline_mask_t aesd_newline_mask(const char *block)
+{
+    __m256i data = _mm256_loadu_si256((const __m256i *)block);
+    return (uint32_t)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(data, _mm256_set1_epi8('\n')));
+}
+
+#elif !defined(__KERNEL__) && defined(__SSE2__)
+
+#define AESD_NEWLINE_BLOCK 16
+#define AESD_NEWLINE_SHIFT 0
+typedef uint32_t aesd_newline_mask_t;
+
+static inline aesd_newline_mask_t aesd_newline_mask(const char *block)
+{
+    __m128i data = _mm_loadu_si128((const __m128i *)block);
+    return (uint32_t)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(data, _mm_set1_epi8('\n')));
+}
+
+#else
+
+#define AESD_NEWLINE_BLOCK sizeof(unsigned long)
+#define AESD_NEWLINE_SHIFT 3
+typedef unsigned long aesd_newline_mask_t;
+
+#define AESD_NEWLINE_ONES (~0UL / 0xff)
+#define AESD_NEWLINE_LOW7 (AESD_NEWLINE_ONES * 0x7f)
+
+/**
+ * Word at a time: sets the top bit of every byte of the word that is '\n',
+ * with byte 0 of the block in the lowest bits.
+ */
+static inline aesd_newline_mask_t aesd_newline_mask(const char *block)
+{
+    unsigned long word;
+    memcpy(&word, block, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = sizeof(word) == 8 ? (unsigned long)__builtin_bswap64(word)
+                             : (unsigned long)__builtin_bswap32(word);
+#endif
+    word ^= AESD_NEWLINE_ONES * '\n';
+    // High bit set in every byte that is non zero, without carries between bytes
+    word = ((word & AESD_NEWLINE_LOW7) + AESD_NEWLINE_LOW7) | word;
+    return ~word & ~AESD_NEWLINE_LOW7;
+}
+
+#endif
+
+/**
+ * @return the byte offset within its block of the lowest newline in @param mask
+ */
+static inline size_t aesd_newline_first(aesd_newline_mask_t mask)
+{
+    return (size_t)__builtin_ctzl((unsigned long)mask) >> AESD_NEWLINE_SHIFT;
+}
+
+/**
+ * Four blocks are checked together to skip quickly over long lines.
+ */
+#define AESD_NEWLINE_STRIDE (4 * AESD_NEWLINE_BLOCK)
+
+static inline int aesd_newline_in_stride(const char *stride)
+{
+    return (aesd_newline_mask(stride) |
+            aesd_newline_mask(stride + AESD_NEWLINE_BLOCK) |
+            aesd_newline_mask(stride + 2 * AESD_NEWLINE_BLOCK) |
+            aesd_newline_mask(stride + 3 * AESD_NEWLINE_BLOCK)) != 0;
+}
+
+/**
+ * @return the index of the first '\n' in the @param len bytes at @param buf,
+ * or len if there is none.
+ */
+static inline size_t aesd_find_newline(const char *buf, size_t len)
+{
+    size_t i = 0;
+    while (i + AESD_NEWLINE_STRIDE <= len && !aesd_newline_in_stride(buf + i))
+        i += AESD_NEWLINE_STRIDE;
+    for (; i + AESD_NEWLINE_BLOCK <= len; i += AESD_NEWLINE_BLOCK) {
+        aesd_newline_mask_t mask = aesd_newline_mask(buf + i);
+        if (mask)
+            return i + aesd_newline_first(mask);
+    }
+    for (; i < len; i++) {
+        if (buf[i] == '\n')
+            return i;
+    }
+    return len;
+}
+
+/**
+ * Called for every complete line found by aesd_split_lines() with the line
+ * including its '\n'. A non zero return value stops the split.
+ */
+typedef int (*aesd_line_fn)(void *ctx, const char *line, size_t len);
+
+/**
+ * Splits the @param len bytes at @param buf into lines in a single pass,
+ * calling @param line_fn for each complete line in order.
+ * @return the number of bytes consumed: the end of the last line accepted by
+ * line_fn. Bytes past it are an unterminated fragment, or the lines from the
+ * one line_fn rejected onwards.
+ */
+static inline size_t aesd_split_lines(const char *buf, size_t len,
+                                      aesd_line_fn line_fn, void *ctx)
+{
+    size_t start = 0;
+    size_t i = 0;
+    for (; i + AESD_NEWLINE_BLOCK <= len; i += AESD_NEWLINE_BLOCK) {
+        if (i % AESD_NEWLINE_STRIDE == 0) {
+            while (i + AESD_NEWLINE_STRIDE <= len &&
+                   !aesd_newline_in_stride(buf + i))
+                i += AESD_NEWLINE_STRIDE;
+            if (i + AESD_NEWLINE_BLOCK > len)
+                break;
+        }
+        aesd_newline_mask_t mask = aesd_newline_mask(buf + i);
+        while (mask) {
+            size_t end = i + aesd_newline_first(mask) + 1;
+            if (line_fn(ctx, buf + start, end - start))
+                return start;
+            start = end;
+            mask &= mask - 1;
+        }
+    }
+    for (; i < len; i++) {
+        if (buf[i] != '\n')
+            continue;
+        if (line_fn(ctx, buf + start, i + 1 - start))
+            return start;
+        start = i + 1;
+    }
+    return start;
+}
+
+#endif /* AESD_NEWLINE_H */
@@ -33,14 +33,159 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * Retention limits of an aesd char device, set with AESDCHAR_IOCSCAPACITY and
+ * read back with AESDCHAR_IOCGCAPACITY
+ */
+struct aesd_capacity {
+    /**
+     * Maximum number of writes retained, 1 to AESDCHAR_MAX_CAPACITY
+     */
+    uint32_t max_writes;
+    uint32_t reserved;
+    /**
+     * Maximum number of bytes retained, 0 for no limit. The most recent write
+     * is always retained.
+     */
+    uint64_t max_bytes;
+};
+
+/**
+ * Upper bound for aesd_capacity.max_writes
+ */
+#define AESDCHAR_MAX_CAPACITY (1U << 20)
+
+/**
+ * Layout of the first page of an mmap of an aesd char device, the stored
+ * writes follow in a ring of data_size bytes starting at data_offset.
+ * Positions count every byte ever written to the device: the byte at
+ * position pos is at data_offset + (pos & (data_size - 1)).
+ *
+ * The device updates the header and ring while writes are added, with
+ * generation odd during an update. To read new data without a syscall, read
+ * an even generation, then head and tail, copy the bytes wanted between them,
+ * and retry if generation changed meanwhile.
+ */
+struct aesd_mmap_header {
+    /**
+     * AESDCHAR_MMAP_MAGIC
+     */
+    uint32_t magic;
+    /**
+     * Offset of the ring from the start of the mapping
+     */
+    uint32_t data_offset;
+    /**
+     * Size of the ring, a power of two
+     */
+    uint64_t data_size;
+    /**
+     * Position of the oldest byte retained, the start of the oldest write the
+     * device holds unless that is more than data_size bytes before tail
+     */
+    uint64_t head;
+    /**
+     * Position just past the newest byte written
+     */
+    uint64_t tail;
+    /**
+     * Incremented before and after each update of the fields and ring
+     */
+    uint64_t generation;
+};
+
+#define AESDCHAR_MMAP_MAGIC 0x61657364
+
+/**
+ * One positioned read of an AESDCHAR_IOCREADBATCH batch, the equivalent of an
+ * AESDCHAR_IOCSEEKTO followed by a read() that stops at the end of the write
+ */
+struct aesd_read_req {
+    /**
+     * The zero referenced write command to read from
+     */
+    uint32_t write_cmd;
+    /**
+     * The zero referenced offset within the write
+     */
+    uint32_t write_cmd_offset;
+    /**
+     * User space buffer to read into, cast to uint64_t
+     */
+    uint64_t buf;
+    /**
+     * Size of buf
+     */
+    uint64_t len;
+    /**
+     * Set by the device to the number of bytes read, or to a negative errno:
+     * -EINVAL if write_cmd or write_cmd_offset is past the stored data,
+     * -EFAULT if buf could not be written
+     */
+    int64_t result;
+};
+
+/**
+ * Argument of AESDCHAR_IOCREADBATCH
+ */
+struct aesd_read_batch {
+    /**
+     * Array of count struct aesd_read_req, cast to uint64_t
+     */
+    uint64_t reqs;
+    /**
+     * Number of requests, at most AESDCHAR_MAX_READ_BATCH
+     */
+    uint32_t count;
+    uint32_t reserved;
+};
+
+/**
+ * Upper bound for aesd_read_batch.count
+ */
+#define AESDCHAR_MAX_READ_BATCH 256
+
+/**
+ * Argument of AESDCHAR_IOCSREADMODE, how reads from one open file behave
+ */
+struct aesd_read_mode {
+    /**
+     * AESD_READ_ flags, 0 for plain reads
+     */
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+/**
+ * A read at the position where the previous read of the same open file found
+ * no more data continues with the write that followed, even if evictions moved
+ * the file positions of the retained writes meanwhile. Meant for a file read
+ * from its file position only, like tail -f does: the device can't tell a
+ * pread() at that position apart and resumes it too. lseek() and
+ * AESDCHAR_IOCSEEKTO start over at the position they set.
+ */
+#define AESD_READ_RESUME 0x1
+/**
+ * A read at the end of the data waits for the next write unless the file is
+ * O_NONBLOCK. Only together with AESD_READ_RESUME, which keeps track of where
+ * the end was while evictions move it. Any other position past the end returns
+ * 0 right away as nothing written later would land there.
+ */
+#define AESD_READ_WAIT 0x2
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+#define AESDCHAR_IOCSCAPACITY _IOW(AESD_IOC_MAGIC, 2, struct aesd_capacity)
+#define AESDCHAR_IOCGCAPACITY _IOR(AESD_IOC_MAGIC, 3, struct aesd_capacity)
+// Fills every request of the batch from the same state of the device, without moving f_pos
+#define AESDCHAR_IOCREADBATCH _IOW(AESD_IOC_MAGIC, 4, struct aesd_read_batch)
+#define AESDCHAR_IOCSREADMODE _IOW(AESD_IOC_MAGIC, 5, struct aesd_read_mode)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 5
 
 #endif /* AESD_IOCTL_H */
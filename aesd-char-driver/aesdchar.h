@@ -11,9 +11,15 @@
 #include "linux/types.h"
 #include <linux/mutex.h>
 #include <linux/cdev.h>
+#include <linux/kref.h>
+#include <linux/rcupdate.h>
+#include <linux/seqlock.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
 #include "aesd-circular-buffer.h"
+#include "aesd_ioctl.h"
 
-#define AESD_DEBUG 1  //Remove comment on this line to enable debug
+//#define AESD_DEBUG 1  //Remove comment on this line to enable debug, or build with DEBUG=y
 
 #undef PDEBUG             /* undef it, just in case */
 #ifdef AESD_DEBUG
@@ -28,16 +34,82 @@
 #  define PDEBUG(fmt, args...) /* not debugging: nothing */
 #endif
 
+/*
+ * Storage of one write held in the circular buffer, entry buffptr points at
+ * data. Readers copy from it without holding the device lock, holding a
+ * reference instead. The last put returns a line from a size class cache to
+ * it at once: the caches are SLAB_TYPESAFE_BY_RCU, so within an RCU read side
+ * section the memory stays a struct aesd_line but may already hold another
+ * write. Readers therefore take their reference with kref_get_unless_zero()
+ * and keep it only if the seqcount shows the entry unchanged. Lines too large
+ * for the caches are kmalloc'd and freed with kfree_rcu().
+ */
+struct aesd_line
+{
+  struct kref ref;
+  unsigned int size_class; /* Cache it was allocated from */
+  struct rcu_head rcu;
+  char data[];
+};
+
+#define AESD_LATENCY_BUCKETS 32
+
+/*
+ * Counters of one device, kept per CPU so that lockless readers updating them
+ * do not bounce a shared cache line. Bucket i of the latency histograms counts
+ * calls that took [2^i, 2^(i+1)) ns; the histograms and lock_wait_ns are only
+ * filled while the timing module parameter is set.
+ */
+struct aesd_stats
+{
+  u64 writes;           /* write calls */
+  u64 lines;            /* Entries added to circ_buffer */
+  u64 bytes_in;
+  u64 reads;            /* read calls */
+  u64 bytes_out;
+  u64 evictions;        /* Entries dropped to make room or on capacity changes */
+  u64 alloc_failures;
+  u64 lock_wait_ns;     /* Time writers waited for lock */
+  u64 write_latency[AESD_LATENCY_BUCKETS];
+  u64 read_latency[AESD_LATENCY_BUCKETS];
+};
+
 struct aesd_dev
 {
   struct cdev cdev;     /* Char device structure      */
-  struct mutex lock;
+  struct mutex lock;    /* Serializes writers and changes to circ_buffer */
+  seqcount_mutex_t seq; /* Lets readers look up circ_buffer without lock */
+  wait_queue_head_t wait; /* Woken when writes are added */
   char * unterminated;
   size_t unterminated_count;
+  size_t unterminated_size;
+  char * write_chunk;     /* Bounce buffer for user data, used under lock */
 
   struct aesd_circular_buffer circ_buffer;
 
+  struct aesd_mmap_header *mmap_header; /* Start of the area shared with mmap, NULL if disabled */
+  char * mmap_ring;       /* Last mmap_ring_size bytes written, after the header page */
+  size_t mmap_ring_size;
+
+  struct aesd_stats __percpu *stats;
+
 };
 
+/*
+ * State of an open file. With AESD_READ_RESUME a read that reaches the end of
+ * the data remembers the stream position it stopped at, so the next read from
+ * the same position continues with the following write even if evictions
+ * moved the file positions of the retained writes meanwhile. Without it every
+ * position is read as is. lseek() and AESDCHAR_IOCSEEKTO clear the state.
+ */
+struct aesd_file
+{
+  struct aesd_dev *dev;
+  unsigned int read_flags; /* AESD_READ_ flags set with AESDCHAR_IOCSREADMODE */
+  spinlock_t eof_lock;  /* Keeps eof_fpos and eof_pos consistent between concurrent reads */
+  loff_t eof_fpos;      /* Position of the last read that found no more data, -1 if none
+                           or repositioned since */
+  size_t eof_pos;       /* Its position among all bytes ever written */
+};
 
 #endif /* AESD_CHAR_DRIVER_AESDCHAR_H_ */
@@ -19,6 +19,23 @@
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
 #include <linux/slab.h>
+#include <linux/kref.h>
+#include <linux/rcupdate.h>
+#include <linux/seqlock.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/atomic.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/uio.h>
+#include <linux/splice.h>
+#include <linux/percpu.h>
+#include <linux/jump_label.h>
+#include <linux/timekeeping.h>
+#include <linux/version.h>
 #include "aesdchar.h"
 #include "linux/errno.h"
 #include "linux/gfp.h"
@@ -26,6 +43,7 @@
 #include "linux/mutex.h"
 #include "linux/string.h"
 #include "aesd-circular-buffer.h"
+#include "aesd-newline.h"
 #include "linux/uaccess.h"
 #include "aesd_ioctl.h"
 #include "access_ok_version.h"
@@ -36,15 +54,98 @@ int aesd_minor =   0;
 MODULE_AUTHOR("Gabor Attila Sztupak");
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct aesd_dev aesd_device;
+static unsigned int max_writes = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param(max_writes, uint, 0444);
+MODULE_PARM_DESC(max_writes, "Number of writes retained, changeable with AESDCHAR_IOCSCAPACITY");
+
+static unsigned long max_bytes = 0;
+module_param(max_bytes, ulong, 0444);
+MODULE_PARM_DESC(max_bytes, "Bytes retained regardless of max_writes, 0 for no limit");
+
+static unsigned long mmap_size = 64 * 1024;
+module_param(mmap_size, ulong, 0444);
+MODULE_PARM_DESC(mmap_size, "Bytes of history available through mmap, rounded up to a power of two, 0 to disable mmap");
+
+/**
+ * Upper bound for ndevices
+ */
+#define AESD_MAX_DEVICES 256
+
+static unsigned int ndevices = 1;
+module_param(ndevices, uint, 0444);
+MODULE_PARM_DESC(ndevices, "Number of devices created, aesdchar0 to aesdchar<ndevices-1>, each with its own history");
+
+/*
+ * Taking timestamps for lock_wait_ns and the latency histograms costs more
+ * than the rest of the accounting, so it sits behind a static key that the
+ * timing parameter flips at runtime.
+ */
+static DEFINE_STATIC_KEY_FALSE(aesd_timing);
+
+static int aesd_timing_set(const char *val, const struct kernel_param *kp)
+{
+    bool enable;
+    int err = kstrtobool(val, &enable);
+    if (err)
+        return err;
+    if (enable)
+        static_branch_enable(&aesd_timing);
+    else
+        static_branch_disable(&aesd_timing);
+    return 0;
+}
+
+static int aesd_timing_get(char *buffer, const struct kernel_param *kp)
+{
+    return sprintf(buffer, "%c\n", static_key_enabled(&aesd_timing) ? 'Y' : 'N');
+}
+
+static const struct kernel_param_ops aesd_timing_ops = {
+    .set = aesd_timing_set,
+    .get = aesd_timing_get,
+};
+module_param_cb(timing, &aesd_timing_ops, NULL, 0644);
+MODULE_PARM_DESC(timing, "Record lock wait time and read/write latency histograms in debugfs");
+
+struct aesd_dev *aesd_devices;
+
+/**
+ * @return the start time of an operation to pass to aesd_latency_bucket(), 0 if timing is off
+ */
+static inline u64 aesd_time_start(void)
+{
+    return static_branch_unlikely(&aesd_timing) ? ktime_get_ns() : 0;
+}
+
+/**
+ * @return the latency histogram bucket of an operation started at @param start
+ */
+static unsigned int aesd_latency_bucket(u64 start)
+{
+    u64 ns = ktime_get_ns() - start;
+    return ns ? min_t(unsigned int, ilog2(ns), AESD_LATENCY_BUCKETS - 1) : 0;
+}
+
+static inline struct aesd_dev *aesd_dev_of(struct file *filp)
+{
+    return ((struct aesd_file *)filp->private_data)->dev;
+}
 
 int aesd_open(struct inode *inode, struct file *filp)
 {
     PDEBUG("open");
 
-	struct aesd_dev *dev;
-    dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
-	filp->private_data = dev;
+	struct aesd_file *file = kmalloc(sizeof(struct aesd_file), GFP_KERNEL);
+    if (!file)
+        return -ENOMEM;
+    file->dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
+    file->read_flags = 0;
+    spin_lock_init(&file->eof_lock);
+    file->eof_fpos = -1;
+    file->eof_pos = 0;
+	filp->private_data = file;
+    // Reads only wait with AESD_READ_WAIT and handle IOCB_NOWAIT there
+    filp->f_mode |= FMODE_NOWAIT;
 
     return 0;
 }
@@ -53,204 +154,674 @@ int aesd_release(struct inode *inode, struct file *filp)
 {
     PDEBUG("release");
 
+    kfree(filp->private_data);
+    return 0;
+}
+
+/**
+ * Lines are allocated from caches of these object sizes, header included, and
+ * larger ones with kmalloc. The caches are SLAB_TYPESAFE_BY_RCU, so the memory
+ * of an evicted line is reused right away instead of after a grace period:
+ * lockless readers already validate any line they find with
+ * kref_get_unless_zero() and the seqcount.
+ */
+static const unsigned int aesd_line_class_size[] = { 64, 256, 1024, 4096 };
+static const char * const aesd_line_class_name[] = {
+    "aesd_line_64", "aesd_line_256", "aesd_line_1k", "aesd_line_4k"
+};
+#define AESD_LINE_CLASSES ARRAY_SIZE(aesd_line_class_size)
+static struct kmem_cache *aesd_line_cache[AESD_LINE_CLASSES];
+
+/*
+ * Allocation counters shown in debugfs, the last element of the arrays
+ * counts kmalloc'd lines.
+ */
+static atomic_long_t aesd_line_allocs[AESD_LINE_CLASSES + 1];
+static atomic_long_t aesd_line_frees[AESD_LINE_CLASSES + 1];
+static atomic_long_t aesd_unterminated_grows;
+
+static struct dentry *aesd_debugfs;
+
+static int aesd_line_caches_create(void)
+{
+    unsigned int i;
+    for (i = 0; i < AESD_LINE_CLASSES; i++) {
+        // Only the data is copied to user space
+        aesd_line_cache[i] = kmem_cache_create_usercopy(aesd_line_class_name[i],
+                aesd_line_class_size[i], 0, SLAB_TYPESAFE_BY_RCU,
+                offsetof(struct aesd_line, data),
+                aesd_line_class_size[i] - offsetof(struct aesd_line, data), NULL);
+        if (!aesd_line_cache[i])
+            return -ENOMEM;
+    }
     return 0;
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
-                  loff_t *f_pos)
+static void aesd_line_caches_destroy(void)
+{
+    unsigned int i;
+    // Lines freed with kfree_rcu() may still be pending
+    rcu_barrier();
+    for (i = 0; i < AESD_LINE_CLASSES; i++)
+        kmem_cache_destroy(aesd_line_cache[i]);
+}
+
+static struct aesd_line *aesd_line_alloc(size_t size)
+{
+    size_t total = sizeof(struct aesd_line) + size;
+    unsigned int size_class = 0;
+    struct aesd_line *line;
+
+    while (size_class < AESD_LINE_CLASSES && total > aesd_line_class_size[size_class])
+        size_class++;
+    if (size_class < AESD_LINE_CLASSES)
+        line = kmem_cache_alloc(aesd_line_cache[size_class], GFP_KERNEL);
+    else
+        line = kmalloc(total, GFP_KERNEL);
+    if (!line)
+        return NULL;
+
+    atomic_long_inc(&aesd_line_allocs[size_class]);
+    line->size_class = size_class;
+    kref_init(&line->ref);
+    return line;
+}
+
+static inline struct aesd_line *aesd_line_of(const char *buffptr)
+{
+    return container_of(buffptr, struct aesd_line, data[0]);
+}
+
+static void aesd_line_release(struct kref *ref)
+{
+    struct aesd_line *line = container_of(ref, struct aesd_line, ref);
+
+    atomic_long_inc(&aesd_line_frees[line->size_class]);
+    if (line->size_class < AESD_LINE_CLASSES)
+        kmem_cache_free(aesd_line_cache[line->size_class], line);
+    else
+        kfree_rcu(line, rcu);
+}
+
+/**
+ * Drops a reference to the line of entry buffptr @param buffptr
+ */
+static void aesd_line_put(const char *buffptr)
+{
+    kref_put(&aesd_line_of(buffptr)->ref, aesd_line_release);
+}
+
+/**
+ * Copies the indexes of the circular buffer of @param dev to @param snap without
+ * taking dev->lock, retrying until they are consistent with each other.
+ * Must be called under rcu_read_lock(), which keeps the entry storage they
+ * refer to allocated.
+ * @return the sequence to check entries read through snap with read_seqcount_retry()
+ */
+static unsigned int aesd_snapshot(struct aesd_dev *dev, struct aesd_circular_buffer *snap)
+{
+    unsigned int seq;
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        memcpy(snap, &dev->circ_buffer, offsetof(struct aesd_circular_buffer, default_entry));
+    } while (read_seqcount_retry(&dev->seq, seq));
+    return seq;
+}
+
+/**
+ * Finds the line holding file position @param fpos without taking dev->lock.
+ * @param offset is set to the position of fpos within the line and @param size to the line size.
+ * @param pos is set to the position of fpos among all bytes ever written.
+ * @return the line with a reference held, or NULL if fpos is past the end of the data
+ */
+static struct aesd_line *aesd_get_line(struct aesd_dev *dev, loff_t fpos,
+                                       size_t *offset, size_t *size, size_t *pos)
+{
+    struct aesd_circular_buffer snap;
+    struct aesd_buffer_entry *entry;
+    struct aesd_line *line;
+    const char *buffptr;
+    unsigned int seq;
+
+    rcu_read_lock();
+    for (;;) {
+        seq = aesd_snapshot(dev, &snap);
+        *pos = snap.end_offset - snap.total_size + fpos;
+        line = NULL;
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(&snap, fpos, offset);
+        if (entry) {
+            buffptr = READ_ONCE(entry->buffptr);
+            *size = READ_ONCE(entry->size);
+            // An entry evicted meanwhile may be on its way to be freed
+            if (buffptr && kref_get_unless_zero(&aesd_line_of(buffptr)->ref))
+                line = aesd_line_of(buffptr);
+        }
+        if (!read_seqcount_retry(&dev->seq, seq))
+            break;
+        if (line)
+            aesd_line_put(buffptr);
+    }
+    rcu_read_unlock();
+    return line;
+}
+
+/**
+ * Remembers that a read of @param file found no more data at @param fpos, position
+ * @param pos among all bytes ever written, when the file resumes reads.
+ */
+static void aesd_set_eof(struct aesd_file *file, loff_t fpos, size_t pos)
+{
+    if (!(READ_ONCE(file->read_flags) & AESD_READ_RESUME))
+        return;
+    spin_lock(&file->eof_lock);
+    file->eof_fpos = fpos;
+    file->eof_pos = pos;
+    spin_unlock(&file->eof_lock);
+}
+
+/**
+ * Forgets where the last read of @param file found no more data, for a new explicit position.
+ */
+static void aesd_clear_eof(struct aesd_file *file)
 {
+    spin_lock(&file->eof_lock);
+    file->eof_fpos = -1;
+    spin_unlock(&file->eof_lock);
+}
+
+/**
+ * @return the file position to read from instead of @param fpos in @param file, moved to
+ * the data following the last read that reached the end when the file resumes reads.
+ * @param total_size is set to the amount of data at the same time.
+ */
+static loff_t aesd_resume_fpos(struct aesd_file *file, loff_t fpos, size_t *total_size)
+{
+    struct aesd_circular_buffer snap;
+    bool resume = false;
+    size_t eof_pos = 0;
+    size_t ahead;
+
+    rcu_read_lock();
+    aesd_snapshot(file->dev, &snap);
+    rcu_read_unlock();
+
+    *total_size = snap.total_size;
+    if (READ_ONCE(file->read_flags) & AESD_READ_RESUME) {
+        spin_lock(&file->eof_lock);
+        resume = fpos == file->eof_fpos;
+        eof_pos = file->eof_pos;
+        spin_unlock(&file->eof_lock);
+    }
+    // A read past the end of the data stopped where nothing was ever written
+    if (!resume || eof_pos > snap.end_offset)
+        return fpos;
+    // Resume at the oldest write if the ones following were evicted too
+    ahead = eof_pos - (snap.end_offset - snap.total_size);
+    return ahead <= snap.total_size ? ahead : 0;
+}
+
+/**
+ * @return true if there is data to read at @param fpos in @param file
+ */
+static bool aesd_readable(struct aesd_file *file, loff_t fpos)
+{
+    size_t total_size;
+    return aesd_resume_fpos(file, fpos, &total_size) < total_size;
+}
+
+/**
+ * Copies the data at iocb->ki_pos to @param to, used for read(), readv(), io_uring and,
+ * through the generic splice helpers, splice() and sendfile().
+ *
+ * Files set to AESD_READ_RESUME continue after the end the previous read reached, any
+ * other file reads exactly the position it is asked to.
+ */
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct file *filp = iocb->ki_filp;
+    loff_t *f_pos = &iocb->ki_pos;
+    size_t count = iov_iter_count(to);
     ssize_t retval = 0;
     PDEBUG("read %zu bytes with offset %lld",count,*f_pos);
 
-    struct aesd_dev *dev = filp->private_data;
-    if (mutex_lock_interruptible(&dev->lock))
-        return -ERESTARTSYS;
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    size_t offset, size, pos, total_size;
+    struct aesd_line *line;
+    u64 start = aesd_time_start();
 
-    char *target = buf;
-    size_t offset;
-    struct aesd_buffer_entry *entry;
+    *f_pos = aesd_resume_fpos(file, *f_pos, &total_size);
 
     while (retval < count) {
-        entry = aesd_circular_buffer_find_entry_offset_for_fpos(
-            &dev->circ_buffer, *f_pos, &offset);
+        line = aesd_get_line(dev, *f_pos, &offset, &size, &pos);
 
-        if (!entry) {
+        if (!line) {
             PDEBUG("couldn't find an entry at offset %lld", *f_pos);
-            goto out;
+            aesd_set_eof(file, *f_pos, pos);
+            if (retval || !(READ_ONCE(file->read_flags) & AESD_READ_WAIT))
+                break;
+            // Only the end of the data waits, nothing written later lands past it
+            if (aesd_resume_fpos(file, *f_pos, &total_size) > total_size)
+                break;
+            if ((filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT)) {
+                retval = -EAGAIN;
+                break;
+            }
+            if (wait_event_interruptible(dev->wait, aesd_readable(file, *f_pos))) {
+                retval = -ERESTARTSYS;
+                break;
+            }
+            *f_pos = aesd_resume_fpos(file, *f_pos, &total_size);
+            continue;
         }
 
-        ssize_t copy_size = min(count-retval, entry->size-offset);
-        ssize_t not_copied = copy_to_user(
-            target,
-            entry->buffptr+offset,
-            copy_size);
+        size_t copy_size = min(count-retval, size-offset);
+        size_t copied = copy_to_iter(
+            line->data+offset,
+            copy_size,
+            to);
+        aesd_line_put(line->data);
 
-        ssize_t copied = copy_size - not_copied;
-
-        target = target + copied;
         *f_pos += copied;
         retval += copied;
 
-        if (!not_copied) {
-            PDEBUG("couldn't copy %d out of %d bytes to user", not_copied, copy_size);
-            goto out;
+        if (copied < copy_size) {
+            PDEBUG("couldn't copy %zu out of %zu bytes", copy_size - copied, copy_size);
+            if (!retval)
+                retval = -EFAULT;
+            break;
         }
 
     }
 
-  out : mutex_unlock(&dev->lock);
-    PDEBUG("finished reading %zu bytes",retval);
+    PDEBUG("finished reading %zd bytes",retval);
+    this_cpu_inc(dev->stats->reads);
+    if (retval > 0)
+        this_cpu_add(dev->stats->bytes_out, retval);
+    if (start)
+        this_cpu_inc(dev->stats->read_latency[aesd_latency_bucket(start)]);
     return retval;
 }
 
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
-{
-    ssize_t retval = 0;
-    PDEBUG("write %zu bytes with offset %lld",count,*f_pos);
+/**
+ * User data is copied in and split in chunks of this size, so a large write
+ * never needs a buffer the size of the whole write.
+ */
+#define AESD_WRITE_CHUNK PAGE_SIZE
 
-    struct aesd_dev *dev = filp->private_data;
-    if (mutex_lock_interruptible(&dev->lock))
-        return -ERESTARTSYS;
+struct aesd_write_ctx {
+    struct aesd_dev *dev;
+    int err;
+    bool added;
+};
 
-    PDEBUG("trying to allocate buffer for input data size %d", dev->unterminated_count+count);
-    char *kbuf = (char *)krealloc(dev->unterminated,
-                                  dev->unterminated_count+count,
-                                  GFP_KERNEL);
-    if (!kbuf) {
-        PDEBUG("failed to allocate buffer for input data size %d", dev->unterminated_count+count);
-        retval = -ENOMEM;
-        goto out;
+/**
+ * Copies the @param len bytes at @param data, just added to the circular buffer
+ * as its newest entry, to the mmap ring and publishes the new head and tail
+ * following the protocol described with struct aesd_mmap_header. Also called
+ * with len 0 after entries were evicted. Must be called with dev->lock held.
+ */
+static void aesd_mmap_update(struct aesd_dev *dev, const char *data, size_t len)
+{
+    struct aesd_mmap_header *header = dev->mmap_header;
+    size_t tail = dev->circ_buffer.end_offset;
+    size_t head = tail - dev->circ_buffer.total_size;
+    size_t ring_size = dev->mmap_ring_size;
+    size_t pos, first;
+
+    if (!header)
+        return;
+    if (tail - head > ring_size)
+        head = tail - ring_size;
+    if (len > ring_size) {
+        data += len - ring_size;
+        len = ring_size;
     }
-    dev->unterminated = kbuf;
 
-    PDEBUG("trying to copy data from user");
-    if (copy_from_user(dev->unterminated+dev->unterminated_count, buf, count)) {
-        PDEBUG("failed to copy data from user");
-        retval = -EFAULT;
-        goto out;
+    WRITE_ONCE(header->generation, header->generation + 1);
+    smp_wmb();
+    // Readers must see the bytes about to be overwritten as gone first
+    WRITE_ONCE(header->head, head);
+    smp_wmb();
+    pos = (tail - len) & (ring_size - 1);
+    first = min(len, ring_size - pos);
+    memcpy(dev->mmap_ring + pos, data, first);
+    memcpy(dev->mmap_ring, data + first, len - first);
+    smp_wmb();
+    WRITE_ONCE(header->tail, tail);
+    smp_wmb();
+    WRITE_ONCE(header->generation, header->generation + 1);
+}
+
+/**
+ * aesd_split_lines() callback storing one complete line as a new entry of the
+ * circular buffer, evicting the oldest entries when it is full or over its
+ * byte budget. A fragment left
+ * unterminated by earlier writes becomes the start of the line, so every entry
+ * is allocated exactly once at its final size.
+ */
+static int aesd_add_line(void *arg, const char *data, size_t len)
+{
+    struct aesd_write_ctx *ctx = arg;
+    struct aesd_dev *dev = ctx->dev;
+    struct aesd_buffer_entry entry;
+    size_t size = dev->unterminated_count + len;
+
+    PDEBUG("trying to allocate buffer for user data of size %zu", size);
+    struct aesd_line *line = aesd_line_alloc(size);
+    if (!line) {
+        PDEBUG("failed to allocate buffer for user data of size %zu", size);
+        this_cpu_inc(dev->stats->alloc_failures);
+        ctx->err = -ENOMEM;
+        return ctx->err;
+    }
+    memcpy(line->data, dev->unterminated, dev->unterminated_count);
+    memcpy(line->data + dev->unterminated_count, data, len);
+    entry.buffptr = line->data;
+    entry.size = size;
+
+    if (dev->unterminated_size > AESD_WRITE_CHUNK) {
+        kfree(dev->unterminated);
+        dev->unterminated = NULL;
+        dev->unterminated_size = 0;
+    }
+    dev->unterminated_count = 0;
+
+    struct aesd_buffer_entry removed;
+    write_seqcount_begin(&dev->seq);
+    while (aesd_circular_buffer_needs_evict(&dev->circ_buffer, size) &&
+           aesd_circular_buffer_pop_entry(&dev->circ_buffer, &removed)) {
+        PDEBUG("freeing up evicted buffer entry");
+        this_cpu_inc(dev->stats->evictions);
+        aesd_line_put(removed.buffptr);
     }
-    dev->unterminated_count += count;
 
-    size_t idx = 0;
-    while (idx < dev->unterminated_count) {
-        if (dev->unterminated[idx] != '\n') {
-            idx ++;
-            continue;
-        }
+    PDEBUG("adding buffer entry of size %zu", entry.size);
+    aesd_circular_buffer_add_entry(&dev->circ_buffer, &entry);
+    write_seqcount_end(&dev->seq);
+    this_cpu_inc(dev->stats->lines);
 
-        struct aesd_buffer_entry entry;
+    aesd_mmap_update(dev, line->data, size);
+    ctx->added = true;
+    return 0;
+}
 
-        PDEBUG("trying to allocate buffer for user data of size %d", idx+1);
-        char *buff = kmalloc(idx+1, GFP_KERNEL);
-        if (!buff) {
-            PDEBUG("failed to allocate buffer for user data of size %d", idx+1);
-            retval = -ENOMEM;
-            goto out;
+/**
+ * Carries a trailing fragment without a newline over to the next write. The
+ * fragment buffer grows geometrically so a long line written in many pieces
+ * is copied a bounded number of times.
+ */
+static int aesd_keep_unterminated(struct aesd_dev *dev, const char *data, size_t len)
+{
+    size_t needed = dev->unterminated_count + len;
+    if (!len)
+        return 0;
+
+    if (needed > dev->unterminated_size) {
+        size_t size = max(needed, 2 * dev->unterminated_size);
+        PDEBUG("growing unterminated buffer to %zu bytes", size);
+        atomic_long_inc(&aesd_unterminated_grows);
+        char *kbuf = krealloc(dev->unterminated, size, GFP_KERNEL);
+        if (!kbuf) {
+            PDEBUG("failed to grow unterminated buffer to %zu bytes", size);
+            this_cpu_inc(dev->stats->alloc_failures);
+            return -ENOMEM;
         }
-        strncpy(buff, dev->unterminated, idx+1);
-        entry.buffptr = buff;
-        entry.size = idx+1;
+        dev->unterminated = kbuf;
+        dev->unterminated_size = size;
+    }
+    memcpy(dev->unterminated + dev->unterminated_count, data, len);
+    dev->unterminated_count = needed;
+    return 0;
+}
+
+/**
+ * Appends the data in @param from, used for write(), writev() and io_uring. The position
+ * is ignored, writes always go to the end.
+ */
+ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    size_t count = iov_iter_count(from);
+    ssize_t retval = 0;
+    size_t done = 0;
+    PDEBUG("write %zu bytes with offset %lld",count,iocb->ki_pos);
+
+    struct aesd_dev *dev = aesd_dev_of(iocb->ki_filp);
+    u64 start = aesd_time_start();
+    if (iocb->ki_flags & IOCB_NOWAIT) {
+        if (!mutex_trylock(&dev->lock))
+            return -EAGAIN;
+    } else if (mutex_lock_interruptible(&dev->lock)) {
+        return -ERESTARTSYS;
+    }
+    if (start)
+        this_cpu_add(dev->stats->lock_wait_ns, ktime_get_ns() - start);
+
+    struct aesd_write_ctx ctx = { .dev = dev, .err = 0, .added = false };
+    while (done < count) {
+        size_t len = min_t(size_t, count - done, AESD_WRITE_CHUNK);
 
-        if (dev->circ_buffer.full) {
-            PDEBUG("freeing up overridden buffer entry");
-            kfree(dev->circ_buffer.entry[dev->circ_buffer.out_offs].buffptr);
+        if (copy_from_iter(dev->write_chunk, len, from) != len) {
+            PDEBUG("failed to copy data from user");
+            retval = -EFAULT;
+            break;
         }
 
-        PDEBUG("adding buffer entry of size %d", entry.size);
-        aesd_circular_buffer_add_entry(&dev->circ_buffer, &entry);
-
-        if (dev->unterminated_count > idx+1) {
-            PDEBUG("reducing unterminated buffer");
-            char * unterminated = kmalloc(dev->unterminated_count - idx - 1,
-                                          GFP_KERNEL);
-            PDEBUG("trying to allocate buffer for remaining data of size %d",
-                   dev->unterminated_count - idx - 1);
-            if (!unterminated) {
-                PDEBUG("failed to allocate buffer for remaining data of size %d",
-                       dev->unterminated_count - idx - 1);
-                retval = -ENOMEM;
-                goto out;
-            }
+        size_t consumed = aesd_split_lines(dev->write_chunk, len,
+                                           aesd_add_line, &ctx);
+        if (ctx.err) {
+            done += consumed;
+            retval = ctx.err;
+            break;
+        }
 
-            strncpy(unterminated, dev->unterminated+idx+1, dev->unterminated_count-idx-1);
-            kfree(dev->unterminated);
-            dev->unterminated = unterminated;
-            dev->unterminated_count = dev->unterminated_count-idx-1;
-            idx = 0;
-        } else {
-            PDEBUG("clearing unterminated");
-            kfree(dev->unterminated);
-            dev->unterminated = NULL;
-            dev->unterminated_count = 0;
-            idx = 0;
+        retval = aesd_keep_unterminated(dev, dev->write_chunk + consumed,
+                                        len - consumed);
+        if (retval) {
+            done += consumed;
+            break;
         }
+        done += len;
     }
-    retval = count;
-    PDEBUG("written %d bytes", retval);
 
-  out:
+    // Report the bytes taken so far; the caller retries the rest.
+    if (done)
+        retval = done;
+    PDEBUG("written %zd bytes", retval);
+    this_cpu_inc(dev->stats->writes);
+    this_cpu_add(dev->stats->bytes_in, done);
+
     mutex_unlock(&dev->lock);
+    if (ctx.added)
+        wake_up_interruptible_poll(&dev->wait, EPOLLIN | EPOLLRDNORM);
+    if (start)
+        this_cpu_inc(dev->stats->write_latency[aesd_latency_bucket(start)]);
     return retval;
 }
 
 loff_t aesd_llseek(struct file *filp, loff_t offset, int whence) {
     PDEBUG("seek to offset %lld with mode %d", offset, whence);
 
-    struct aesd_dev *dev = filp->private_data;
-    if (mutex_lock_interruptible(&dev->lock))
-        return -ERESTARTSYS;
+    struct aesd_file *file = filp->private_data;
+    struct aesd_circular_buffer snap;
+    loff_t retval;
 
-    loff_t size = 0;
-    uint8_t index;
-    struct aesd_buffer_entry *entry;
-    AESD_CIRCULAR_BUFFER_FOREACH(entry, &dev->circ_buffer, index) {
-        size += entry->size;
-    }
-
-    loff_t retval = fixed_size_llseek(filp, offset, whence, size);
+    rcu_read_lock();
+    aesd_snapshot(file->dev, &snap);
+    rcu_read_unlock();
 
-  out:
-    mutex_unlock(&dev->lock);
+    retval = fixed_size_llseek(filp, offset, whence, snap.total_size);
+    // An explicit position is read as is, not resumed after the last end reached
+    if (retval >= 0)
+        aesd_clear_eof(file);
     return retval;
 }
 
 long aesd_adjust_file_offset(struct file *filp, struct aesd_seekto *seekto) {
     PDEBUG("adjust file offset to command %d, offset %d", seekto->write_cmd, seekto->write_cmd_offset);
+    struct aesd_dev *dev = aesd_dev_of(filp);
+    struct aesd_circular_buffer snap;
+    struct aesd_buffer_entry *entry;
+    size_t size = 0;
+    loff_t fpos = 0;
+    unsigned int seq;
+
+    rcu_read_lock();
+    do {
+        seq = aesd_snapshot(dev, &snap);
+        entry = aesd_circular_buffer_entry_at(&snap, seekto->write_cmd);
+        if (entry) {
+            size = READ_ONCE(entry->size);
+            fpos = aesd_circular_buffer_entry_fpos(&snap, entry);
+        }
+    } while (read_seqcount_retry(&dev->seq, seq));
+    rcu_read_unlock();
+
+    if (!entry) {
+        PDEBUG("seting offset fail due to too large cmd index");
+        return -EINVAL;
+    }
+    if (size <= seekto->write_cmd_offset) {
+        PDEBUG("seting offset fail due to too long cmd offset");
+        return -EINVAL;
+    }
+
+    filp->f_pos = fpos + seekto->write_cmd_offset;
+    aesd_clear_eof(filp->private_data);
+    PDEBUG("seting offset to %lld", filp->f_pos);
+    return 0;
+}
+
+
+/**
+ * Changes how many writes and bytes the device retains, evicting the oldest
+ * entries that no longer fit. Must be called with dev->lock held.
+ */
+static int aesd_set_capacity(struct aesd_dev *dev, const struct aesd_capacity *cap)
+{
+    struct aesd_circular_buffer *buffer = &dev->circ_buffer;
+    struct aesd_buffer_entry *storage = NULL;
+    struct aesd_buffer_entry removed;
+
+    if (!cap->max_writes || cap->max_writes > AESDCHAR_MAX_CAPACITY)
+        return -EINVAL;
+
+    if (cap->max_writes > AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
+        storage = kvmalloc_array(cap->max_writes, sizeof(*storage), GFP_KERNEL);
+        if (!storage)
+            return -ENOMEM;
+    }
+
+    write_seqcount_begin(&dev->seq);
+    while (buffer->count > cap->max_writes &&
+           aesd_circular_buffer_pop_entry(buffer, &removed)) {
+        this_cpu_inc(dev->stats->evictions);
+        aesd_line_put(removed.buffptr);
+    }
+    storage = aesd_circular_buffer_set_storage(buffer, storage, cap->max_writes);
+
+    buffer->max_bytes = cap->max_bytes;
+    while (buffer->max_bytes && buffer->total_size > buffer->max_bytes &&
+           buffer->count > 1 && aesd_circular_buffer_pop_entry(buffer, &removed)) {
+        this_cpu_inc(dev->stats->evictions);
+        aesd_line_put(removed.buffptr);
+    }
+    write_seqcount_end(&dev->seq);
+    aesd_mmap_update(dev, NULL, 0);
+
+    // Lockless readers may still be looking at the previous storage
+    if (storage) {
+        synchronize_rcu();
+        kvfree(storage);
+    }
+
+    PDEBUG("capacity set to %u writes, %zu bytes", buffer->capacity, buffer->max_bytes);
+    return 0;
+}
+
+/**
+ * A line pinned for one request of a read batch
+ */
+struct aesd_batch_slot {
+    struct aesd_line *line;     /* NULL if the request is invalid */
+    size_t offset;
+    size_t len;
+};
+
+/**
+ * Serves the positioned reads of @param batch. Every requested line is looked
+ * up and pinned under a single acquisition of dev->lock, so the whole batch
+ * sees the same writes, then the lock is dropped before copying to user space
+ * so writers are not held up by page faults.
+ */
+static long aesd_read_batch(struct aesd_dev *dev, const struct aesd_read_batch *batch)
+{
+    struct aesd_read_req __user *ureqs = u64_to_user_ptr(batch->reqs);
+    struct aesd_read_req *reqs;
+    struct aesd_batch_slot *slots;
+    size_t copied = 0;
     long retval = 0;
+    uint32_t i;
 
-    struct aesd_dev *dev = filp->private_data;
-    if (mutex_lock_interruptible(&dev->lock))
-        return -ERESTARTSYS;
+    if (!batch->count)
+        return 0;
+    if (batch->count > AESDCHAR_MAX_READ_BATCH || batch->reserved)
+        return -EINVAL;
 
-    loff_t prev_size = 0;
-    uint8_t index;
-    struct aesd_buffer_entry *entry;
-    AESD_CIRCULAR_BUFFER_FOREACH(entry, &dev->circ_buffer, index) {
-        if (index == seekto->write_cmd) {
-            if (entry->size > seekto->write_cmd_offset) {
-                PDEBUG("seting offset to %d", prev_size + seekto->write_cmd_offset);
-                filp->f_pos = prev_size + seekto->write_cmd_offset;
-                retval = 0;
-                goto out;
-            } else {
-                PDEBUG("seting offset fail due to too long cmd offset");
-                retval = -EINVAL;
-                goto out;
-            }
-        } else {
-            prev_size += entry->size;
+    reqs = kmalloc_array(batch->count, sizeof(*reqs), GFP_KERNEL);
+    slots = kmalloc_array(batch->count, sizeof(*slots), GFP_KERNEL);
+    if (!reqs || !slots) {
+        retval = -ENOMEM;
+        goto out;
+    }
+    if (copy_from_user(reqs, ureqs, batch->count * sizeof(*reqs))) {
+        retval = -EFAULT;
+        goto out;
+    }
+
+    if (mutex_lock_interruptible(&dev->lock)) {
+        retval = -ERESTARTSYS;
+        goto out;
+    }
+    for (i = 0; i < batch->count; i++) {
+        struct aesd_buffer_entry *entry =
+            aesd_circular_buffer_entry_at(&dev->circ_buffer, reqs[i].write_cmd);
+        slots[i].line = NULL;
+        if (!entry || entry->size <= reqs[i].write_cmd_offset)
+            continue;
+        slots[i].line = aesd_line_of(entry->buffptr);
+        slots[i].offset = reqs[i].write_cmd_offset;
+        slots[i].len = min_t(size_t, reqs[i].len, entry->size - slots[i].offset);
+        kref_get(&slots[i].line->ref);
+    }
+    mutex_unlock(&dev->lock);
+
+    for (i = 0; i < batch->count; i++) {
+        struct aesd_batch_slot *slot = &slots[i];
+        if (!slot->line) {
+            reqs[i].result = -EINVAL;
+            continue;
         }
+        if (copy_to_user(u64_to_user_ptr(reqs[i].buf), slot->line->data + slot->offset, slot->len))
+            reqs[i].result = -EFAULT;
+        else
+            reqs[i].result = slot->len;
+        if (reqs[i].result > 0)
+            copied += reqs[i].result;
+        aesd_line_put(slot->line->data);
     }
-    PDEBUG("seting offset fail due to too large cmd index");
-    retval = -EINVAL;
+    PDEBUG("read batch of %u requests, %zu bytes", batch->count, copied);
+    this_cpu_inc(dev->stats->reads);
+    this_cpu_add(dev->stats->bytes_out, copied);
 
+    if (copy_to_user(ureqs, reqs, batch->count * sizeof(*reqs)))
+        retval = -EFAULT;
   out:
-    mutex_unlock(&dev->lock);
+    kfree(slots);
+    kfree(reqs);
     return retval;
 }
 
-
 long aesd_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
     PDEBUG("ioctl with cmd %d, arg %ld", cmd, arg);
     long retval = 0;
@@ -268,12 +839,59 @@ long aesd_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
         case AESDCHAR_IOCSEEKTO: {
             struct aesd_seekto seekto;
             if (copy_from_user(&seekto, (const void __user *)arg, sizeof(seekto)) != 0) {
-                retval = EFAULT;
+                retval = -EFAULT;
             } else {
                 retval = aesd_adjust_file_offset(filp, &seekto);
             }
             break;
         }
+        case AESDCHAR_IOCSCAPACITY: {
+            struct aesd_dev *dev = aesd_dev_of(filp);
+            struct aesd_capacity cap;
+            if (copy_from_user(&cap, (const void __user *)arg, sizeof(cap)) != 0) {
+                retval = -EFAULT;
+            } else if (mutex_lock_interruptible(&dev->lock)) {
+                retval = -ERESTARTSYS;
+            } else {
+                retval = aesd_set_capacity(dev, &cap);
+                mutex_unlock(&dev->lock);
+            }
+            break;
+        }
+        case AESDCHAR_IOCGCAPACITY: {
+            struct aesd_dev *dev = aesd_dev_of(filp);
+            struct aesd_capacity cap = { 0 };
+            if (mutex_lock_interruptible(&dev->lock))
+                return -ERESTARTSYS;
+            cap.max_writes = dev->circ_buffer.capacity;
+            cap.max_bytes = dev->circ_buffer.max_bytes;
+            mutex_unlock(&dev->lock);
+            if (copy_to_user((void __user *)arg, &cap, sizeof(cap)) != 0)
+                retval = -EFAULT;
+            break;
+        }
+        case AESDCHAR_IOCREADBATCH: {
+            struct aesd_read_batch batch;
+            if (copy_from_user(&batch, (const void __user *)arg, sizeof(batch)) != 0)
+                retval = -EFAULT;
+            else
+                retval = aesd_read_batch(aesd_dev_of(filp), &batch);
+            break;
+        }
+        case AESDCHAR_IOCSREADMODE: {
+            struct aesd_file *file = filp->private_data;
+            struct aesd_read_mode mode;
+            if (copy_from_user(&mode, (const void __user *)arg, sizeof(mode)) != 0) {
+                retval = -EFAULT;
+            } else if ((mode.flags & ~(AESD_READ_RESUME | AESD_READ_WAIT)) ||
+                       ((mode.flags & AESD_READ_WAIT) && !(mode.flags & AESD_READ_RESUME))) {
+                retval = -EINVAL;
+            } else {
+                WRITE_ONCE(file->read_flags, mode.flags);
+                aesd_clear_eof(file);
+            }
+            break;
+        }
         default:
             retval = -ENOTTY;
     }
@@ -281,19 +899,111 @@ long aesd_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
     return retval;
 }
 
+/**
+ * Maps the header page and ring described by struct aesd_mmap_header, read only.
+ */
+static int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct aesd_dev *dev = aesd_dev_of(filp);
+    PDEBUG("mmap %lu bytes at page %lu", vma->vm_end - vma->vm_start, vma->vm_pgoff);
+
+    if (!dev->mmap_header)
+        return -ENODEV;
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,3,0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+    return remap_vmalloc_range(vma, dev->mmap_header, vma->vm_pgoff);
+}
+
+/**
+ * Reports the file readable when there is data past its f_pos, writes never block.
+ */
+static __poll_t aesd_poll(struct file *filp, struct poll_table_struct *wait)
+{
+    struct aesd_file *file = filp->private_data;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+    poll_wait(filp, &file->dev->wait, wait);
+    if (aesd_readable(file, READ_ONCE(filp->f_pos)))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    return mask;
+}
+
+static int aesd_alloc_stats_show(struct seq_file *s, void *unused)
+{
+    unsigned int i;
+
+    seq_printf(s, "%-8s %12s %12s %12s\n", "class", "allocs", "frees", "in use");
+    for (i = 0; i <= AESD_LINE_CLASSES; i++) {
+        long allocs = atomic_long_read(&aesd_line_allocs[i]);
+        long frees = atomic_long_read(&aesd_line_frees[i]);
+        if (i < AESD_LINE_CLASSES)
+            seq_printf(s, "%-8u", aesd_line_class_size[i]);
+        else
+            seq_printf(s, "%-8s", "kmalloc");
+        seq_printf(s, " %12ld %12ld %12ld\n", allocs, frees, allocs - frees);
+    }
+    seq_printf(s, "unterminated_grows %ld\n", atomic_long_read(&aesd_unterminated_grows));
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aesd_alloc_stats);
+
+static int aesd_dev_stats_show(struct seq_file *s, void *unused)
+{
+    struct aesd_dev *dev = s->private;
+    struct aesd_stats sum = { 0 };
+    u64 *total = (u64 *)&sum;
+    unsigned int cpu, i;
+
+    // struct aesd_stats holds nothing but u64 counters
+    for_each_possible_cpu(cpu) {
+        const u64 *counter = (const u64 *)per_cpu_ptr(dev->stats, cpu);
+        for (i = 0; i < sizeof(sum) / sizeof(u64); i++)
+            total[i] += READ_ONCE(counter[i]);
+    }
+
+    seq_printf(s, "writes %llu\n", sum.writes);
+    seq_printf(s, "lines %llu\n", sum.lines);
+    seq_printf(s, "bytes_in %llu\n", sum.bytes_in);
+    seq_printf(s, "reads %llu\n", sum.reads);
+    seq_printf(s, "bytes_out %llu\n", sum.bytes_out);
+    seq_printf(s, "evictions %llu\n", sum.evictions);
+    seq_printf(s, "alloc_failures %llu\n", sum.alloc_failures);
+    seq_printf(s, "lock_wait_ns %llu\n", sum.lock_wait_ns);
+    seq_printf(s, "%-12s %12s %12s\n", "latency_ns", "reads", "writes");
+    for (i = 0; i < AESD_LATENCY_BUCKETS; i++) {
+        if (sum.read_latency[i] || sum.write_latency[i])
+            seq_printf(s, "%-12llu %12llu %12llu\n", 1ULL << i,
+                       sum.read_latency[i], sum.write_latency[i]);
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aesd_dev_stats);
+
 struct file_operations aesd_fops = {
     .owner =    THIS_MODULE,
-    .read =     aesd_read,
-    .write =    aesd_write,
+    .read_iter = aesd_read_iter,
+    .write_iter = aesd_write_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,5,0)
+    .splice_read = copy_splice_read,
+#else
+    .splice_read = generic_file_splice_read,
+#endif
     .open =     aesd_open,
     .release =  aesd_release,
     .llseek =   aesd_llseek,
+    .mmap =     aesd_mmap,
+    .poll =     aesd_poll,
     .unlocked_ioctl = aesd_unlocked_ioctl
 };
 
-static int aesd_setup_cdev(struct aesd_dev *dev)
+static int aesd_setup_cdev(struct aesd_dev *dev, unsigned int index)
 {
-    int err, devno = MKDEV(aesd_major, aesd_minor);
+    int err, devno = MKDEV(aesd_major, aesd_minor + index);
 
     cdev_init(&dev->cdev, &aesd_fops);
     dev->cdev.owner = THIS_MODULE;
@@ -307,42 +1017,139 @@ static int aesd_setup_cdev(struct aesd_dev *dev)
 
 
 
+/**
+ * Sets up the state of @param dev, zeroed by the caller, and makes it available as
+ * minor @param index. On failure whatever was set up is released with aesd_dev_free().
+ */
+static int aesd_dev_init(struct aesd_dev *dev, unsigned int index)
+{
+    int result;
+
+    mutex_init(&dev->lock);
+    seqcount_mutex_init(&dev->seq, &dev->lock);
+    init_waitqueue_head(&dev->wait);
+    aesd_circular_buffer_init(&dev->circ_buffer);
+    dev->unterminated = NULL;
+    dev->unterminated_count = 0;
+    dev->unterminated_size = 0;
+    dev->write_chunk = kmalloc(AESD_WRITE_CHUNK, GFP_KERNEL);
+    if (!dev->write_chunk)
+        return -ENOMEM;
+    dev->stats = alloc_percpu(struct aesd_stats);
+    if (!dev->stats)
+        return -ENOMEM;
+
+    if (mmap_size) {
+        size_t ring_size = roundup_pow_of_two(max_t(unsigned long, mmap_size, PAGE_SIZE));
+        dev->mmap_header = vmalloc_user(PAGE_SIZE + ring_size);
+        if (!dev->mmap_header)
+            return -ENOMEM;
+        dev->mmap_header->magic = AESDCHAR_MMAP_MAGIC;
+        dev->mmap_header->data_offset = PAGE_SIZE;
+        dev->mmap_header->data_size = ring_size;
+        dev->mmap_ring = (char *)dev->mmap_header + PAGE_SIZE;
+        dev->mmap_ring_size = ring_size;
+    }
+
+    struct aesd_capacity cap = { .max_writes = max_writes, .max_bytes = max_bytes };
+    mutex_lock(&dev->lock);
+    result = aesd_set_capacity(dev, &cap);
+    mutex_unlock(&dev->lock);
+    if (result)
+        return result;
+
+    return aesd_setup_cdev(dev, index);
+}
+
+/**
+ * Releases the memory held by @param dev, which must no longer be reachable.
+ */
+static void aesd_dev_free(struct aesd_dev *dev)
+{
+    struct aesd_buffer_entry removed;
+
+    while (aesd_circular_buffer_pop_entry(&dev->circ_buffer, &removed))
+        aesd_line_put(removed.buffptr);
+    kvfree(aesd_circular_buffer_set_storage(&dev->circ_buffer, NULL,
+                                            AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED));
+
+    vfree(dev->mmap_header);
+    kfree(dev->unterminated);
+    kfree(dev->write_chunk);
+    free_percpu(dev->stats);
+}
+
 int aesd_init_module(void)
 {
     dev_t dev = 0;
+    unsigned int i;
     int result;
-    result = alloc_chrdev_region(&dev, aesd_minor, 1,
+
+    if (!ndevices || ndevices > AESD_MAX_DEVICES) {
+        printk(KERN_WARNING "ndevices must be 1 to %d\n", AESD_MAX_DEVICES);
+        return -EINVAL;
+    }
+    result = alloc_chrdev_region(&dev, aesd_minor, ndevices,
             "aesdchar");
     aesd_major = MAJOR(dev);
     if (result < 0) {
         printk(KERN_WARNING "Can't get major %d\n", aesd_major);
         return result;
     }
-    memset(&aesd_device,0,sizeof(struct aesd_dev));
 
-    mutex_init(&aesd_device.lock);
-    aesd_device.unterminated = NULL;
-    aesd_device.unterminated_count = 0;
-    aesd_circular_buffer_init(&aesd_device.circ_buffer);
+    result = aesd_line_caches_create();
+    if (result)
+        goto fail_caches;
 
-    result = aesd_setup_cdev(&aesd_device);
+    aesd_devices = kcalloc(ndevices, sizeof(struct aesd_dev), GFP_KERNEL);
+    if (!aesd_devices) {
+        result = -ENOMEM;
+        goto fail_caches;
+    }
+    for (i = 0; i < ndevices; i++) {
+        result = aesd_dev_init(&aesd_devices[i], i);
+        if (result) {
+            aesd_dev_free(&aesd_devices[i]);
+            goto fail;
+        }
+    }
 
-    if( result ) {
-        unregister_chrdev_region(dev, 1);
+    aesd_debugfs = debugfs_create_dir("aesdchar", NULL);
+    debugfs_create_file("alloc_stats", 0444, aesd_debugfs, NULL, &aesd_alloc_stats_fops);
+    for (i = 0; i < ndevices; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "aesdchar%u", i);
+        debugfs_create_file("stats", 0444, debugfs_create_dir(name, aesd_debugfs),
+                            &aesd_devices[i], &aesd_dev_stats_fops);
     }
-    return result;
+    return 0;
 
+  fail:
+    while (i--) {
+        cdev_del(&aesd_devices[i].cdev);
+        aesd_dev_free(&aesd_devices[i]);
+    }
+    kfree(aesd_devices);
+  fail_caches:
+    aesd_line_caches_destroy();
+    unregister_chrdev_region(dev, ndevices);
+    return result;
 }
 
 void aesd_cleanup_module(void)
 {
     dev_t devno = MKDEV(aesd_major, aesd_minor);
+    unsigned int i;
 
-    cdev_del(&aesd_device.cdev);
-
-    kfree(aesd_device.unterminated);
+    debugfs_remove_recursive(aesd_debugfs);
+    for (i = 0; i < ndevices; i++) {
+        cdev_del(&aesd_devices[i].cdev);
+        aesd_dev_free(&aesd_devices[i]);
+    }
+    kfree(aesd_devices);
+    aesd_line_caches_destroy();
 
-    unregister_chrdev_region(devno, 1);
+    unregister_chrdev_region(devno, ndevices);
 }
 
 
@@ -0,0 +1,147 @@
+/**
+ * @file aesdchar-read-stress.c
+ * @brief Measures how read throughput of an aesdchar device scales with the
+ * number of reader threads while a writer keeps appending lines.
+ *
+ * Usage: aesdchar-read-stress [device] [seconds per round]
+ * Defaults to /dev/aesdchar and 2 seconds. Prints one row per reader count.
+ * Every byte read is checked to come from the lines the writer produces, so
+ * a reader copying an entry freed under it shows up as corrupt data.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define READ_SIZE 4096
+#define MAX_READERS 16
+
+static const char *device = "/dev/aesdchar";
+static atomic_int stop;
+static atomic_ulong bytes_read;
+static atomic_ulong bad_bytes;
+static atomic_ulong lines_written;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Appends lines of one repeated lower case letter, 1 to 200 long.
+ */
+static void * th_writer(void * arg)
+{
+    char line[202];
+    unsigned long i = 0;
+    int fd = open(device, O_WRONLY);
+    (void)arg;
+
+    if (fd < 0) {
+        perror(device);
+        exit(1);
+    }
+    while (!atomic_load(&stop)) {
+        size_t len = 1 + i % 200;
+        memset(line, 'a' + i % 26, len);
+        line[len] = '\n';
+        if (write(fd, line, len + 1) < 0 && errno != EINTR) {
+            perror("write");
+            exit(1);
+        }
+        i++;
+    }
+    atomic_fetch_add(&lines_written, i);
+    close(fd);
+    return NULL;
+}
+
+/**
+ * Reads the whole device over and over with positioned reads.
+ */
+static void * th_reader(void * arg)
+{
+    char buf[READ_SIZE];
+    unsigned long total = 0;
+    unsigned long bad = 0;
+    int fd = open(device, O_RDONLY);
+    (void)arg;
+
+    if (fd < 0) {
+        perror(device);
+        exit(1);
+    }
+    while (!atomic_load(&stop)) {
+        off_t offset = 0;
+        ssize_t len;
+        while ((len = pread(fd, buf, sizeof(buf), offset)) > 0) {
+            for (ssize_t i = 0; i < len; i++) {
+                if (buf[i] != '\n' && (buf[i] < 'a' || buf[i] > 'z'))
+                    bad++;
+            }
+            offset += len;
+            total += len;
+            if (atomic_load(&stop))
+                break;
+        }
+    }
+    atomic_fetch_add(&bytes_read, total);
+    atomic_fetch_add(&bad_bytes, bad);
+    close(fd);
+    return NULL;
+}
+
+static double run(int readers, double seconds)
+{
+    pthread_t writer;
+    pthread_t reader[MAX_READERS];
+    struct timespec round = { (time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9) };
+
+    atomic_store(&stop, 0);
+    atomic_store(&bytes_read, 0);
+    atomic_store(&lines_written, 0);
+    pthread_create(&writer, NULL, th_writer, NULL);
+    for (int i = 0; i < readers; i++)
+        pthread_create(&reader[i], NULL, th_reader, NULL);
+
+    double start = now_sec();
+    nanosleep(&round, NULL);
+    atomic_store(&stop, 1);
+    for (int i = 0; i < readers; i++)
+        pthread_join(reader[i], NULL);
+    double elapsed = now_sec() - start;
+    pthread_join(writer, NULL);
+
+    return atomic_load(&bytes_read) / elapsed / (1024 * 1024);
+}
+
+int main(int argc, char *argv[])
+{
+    const int counts[] = { 1, 2, 4, 8, 16 };
+    double seconds = 2.0;
+
+    if (argc > 1)
+        device = argv[1];
+    if (argc > 2)
+        seconds = atof(argv[2]);
+
+    printf("%8s %12s %14s %14s\n", "readers", "total MB/s", "per reader", "writes/s");
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        double mbs = run(counts[c], seconds);
+        printf("%8d %12.1f %14.1f %14.0f\n", counts[c], mbs, mbs / counts[c],
+               atomic_load(&lines_written) / seconds);
+    }
+    if (atomic_load(&bad_bytes)) {
+        fprintf(stderr, "%lu corrupt bytes read\n", atomic_load(&bad_bytes));
+        return 1;
+    }
+    return 0;
+}
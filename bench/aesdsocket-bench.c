@@ -0,0 +1,418 @@
+/**
+ * @file aesdsocket-bench.c
+ * @brief Compares the aesdsocket I/O engines: measures line throughput and
+ * round trip latency with several connections sending lines concurrently.
+ *
+ * Start the server with the engine to measure, for example "aesdsocket -e" or
+ * "aesdsocket -u", then run
+ *   aesdsocket-bench [-c connections] [-n lines] [-s size] [-r readers] [-i idle]
+ *                    [-p server pid] [-j] [host]
+ * Defaults to 16 connections sending 2000 lines of 64 bytes to localhost.
+ * Connections ask for tail replies so each round trip only returns the new
+ * data. A server writing to /dev/aesdchar keeps sending full replies, so there
+ * the bytes received per line grow with the history the device retains;
+ * compare the two backends by the bytes/s printed along with the latencies.
+ * With -j the results are printed as one JSON object instead, for collecting
+ * runs in scripts.
+ * With -p the CPU time the server spent per line is printed too, which is
+ * where the system calls saved by io_uring show up.
+ * With -r that many more connections read the whole file back over and over
+ * with binary READ frames while the lines are sent, which shows whether
+ * readers slow the appends down.
+ * With -i that many idle connections are opened first and held until the end,
+ * as many mostly silent clients would; with -p the resident memory and thread
+ * count of the server holding them are printed as well.
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <endian.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aesdsocket_frame.h"
+
+static const char *host = "localhost";
+static int connections = 16;
+static int lines = 2000;
+static int line_size = 64;
+
+struct client {
+    pthread_t thread;
+    int id;
+    double *latency;
+    unsigned long long received;
+    int failed;
+};
+
+struct reader {
+    pthread_t thread;
+    unsigned long replies;
+    unsigned long long bytes;
+    int failed;
+};
+
+static atomic_int sending;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connect_server(void)
+{
+    struct addrinfo hints, *res;
+    int fd;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, "9000", &hints, &res) != 0)
+        return -1;
+    fd = socket(res->ai_family, res->ai_socktype, 0);
+    if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+static int send_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t sent = send(fd, buf, len, MSG_NOSIGNAL);
+        if (sent <= 0)
+            return -1;
+        buf += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+static int recv_all(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    while (len > 0) {
+        ssize_t got = recv(fd, p, len, 0);
+        if (got <= 0)
+            return -1;
+        p += got;
+        len -= got;
+    }
+    return 0;
+}
+
+/**
+ * Reads the whole file back with one READ frame after the other for as long
+ * as the clients are sending.
+ */
+static void * th_reader(void * arg)
+{
+    struct reader *r = arg;
+    static char scratch[1 << 16];
+    const char *mode = "AESDSOCKET_MODE:binary\n";
+    int fd = connect_server();
+    struct {
+        struct aesd_frame_header hdr;
+        struct aesd_frame_read range;
+    } __attribute__((packed)) req;
+
+    if (fd < 0 || send_all(fd, mode, strlen(mode)) != 0) {
+        r->failed = 1;
+        goto out;
+    }
+    req.hdr.magic = htons(AESD_FRAME_MAGIC);
+    req.hdr.type = AESD_FRAME_READ;
+    req.hdr.flags = 0;
+    req.hdr.length = htonl(sizeof(req.range));
+    req.range.offset = 0;
+    req.range.length = htobe64(UINT64_MAX);
+    while (atomic_load(&sending)) {
+        struct aesd_frame_header hdr;
+        req.hdr.sequence = htonl(r->replies);
+        if (send_all(fd, (const char *)&req, sizeof(req)) != 0 ||
+            recv_all(fd, &hdr, sizeof(hdr)) != 0 || hdr.type != AESD_FRAME_DATA) {
+            r->failed = 1;
+            break;
+        }
+        for (size_t left = ntohl(hdr.length); left > 0; ) {
+            size_t chunk = left < sizeof(scratch) ? left : sizeof(scratch);
+            if (recv_all(fd, scratch, chunk) != 0) {
+                r->failed = 1;
+                goto out;
+            }
+            left -= chunk;
+        }
+        r->replies++;
+        r->bytes += ntohl(hdr.length);
+    }
+out:
+    if (fd >= 0)
+        close(fd);
+    return NULL;
+}
+
+/**
+ * Sends lines one at a time, each time waiting until the reply contains it.
+ * Replies also carry the lines of the other connections, so only the last
+ * line_size bytes received are kept to find a line split between receives.
+ */
+static void * th_client(void * arg)
+{
+    struct client *c = arg;
+    size_t window = 2 * (size_t)line_size + 65536;
+    char *line = malloc(line_size);
+    char *buf = malloc(window);
+    int fd = connect_server();
+    const char *mode = "AESDSOCKET_MODE:tail\n";
+
+    if (!line || !buf || fd < 0 || send_all(fd, mode, strlen(mode)) != 0) {
+        c->failed = 1;
+        goto out;
+    }
+    for (int i = 0; i < lines; i++) {
+        int prefix = snprintf(line, line_size, "%d-%d-", c->id, i);
+        memset(line + prefix, 'a' + i % 26, line_size - prefix - 1);
+        line[line_size - 1] = '\n';
+
+        double start = now_sec();
+        size_t have = 0;
+        if (send_all(fd, line, line_size) != 0) {
+            c->failed = 1;
+            break;
+        }
+        while (!memmem(buf, have, line, line_size)) {
+            if (have > (size_t)line_size) {
+                memmove(buf, buf + have - line_size, line_size);
+                have = line_size;
+            }
+            ssize_t len = recv(fd, buf + have, window - have, 0);
+            if (len <= 0) {
+                c->failed = 1;
+                goto out;
+            }
+            have += len;
+            c->received += len;
+        }
+        c->latency[i] = now_sec() - start;
+    }
+out:
+    if (fd >= 0)
+        close(fd);
+    free(buf);
+    free(line);
+    return NULL;
+}
+
+/**
+ * @return the CPU seconds used so far by process @param pid, -1 if unknown
+ */
+static double cpu_seconds(int pid)
+{
+    char path[64];
+    unsigned long utime, stime;
+    FILE *f;
+    int n;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+    // Fields 14 and 15, after the command name in parentheses
+    n = fscanf(f, "%*d (%*[^)]) %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+               &utime, &stime);
+    fclose(f);
+    return n == 2 ? (double)(utime + stime) / sysconf(_SC_CLK_TCK) : -1;
+}
+
+/**
+ * Reads the resident memory in kB and thread count of process @param pid
+ * into @param rss and @param threads.
+ * @return 0, or -1 if the process is unknown
+ */
+static int read_memory(int pid, unsigned long *rss, unsigned long *threads)
+{
+    char path[64], line[128];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+    *rss = *threads = 0;
+    while (fgets(line, sizeof(line), f)) {
+        sscanf(line, "VmRSS: %lu", rss);
+        sscanf(line, "Threads: %lu", threads);
+    }
+    fclose(f);
+    return 0;
+}
+
+/**
+ * Opens @param count connections that never send anything, their descriptors
+ * are stored in @param fds.
+ * @return the number opened
+ */
+static int open_idle(int *fds, int count)
+{
+    struct rlimit rl;
+    int i;
+
+    // Every idle connection is a descriptor here too
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    for (i = 0; i < count; i++) {
+        fds[i] = connect_server();
+        if (fds[i] < 0)
+            break;
+    }
+    return i;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[])
+{
+    int pid = 0;
+    int idle = 0;
+    int readers = 0;
+    int json = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:n:s:r:i:p:j")) != -1) {
+        switch (opt) {
+        case 'c': connections = atoi(optarg); break;
+        case 'n': lines = atoi(optarg); break;
+        case 's': line_size = atoi(optarg); break;
+        case 'r': readers = atoi(optarg); break;
+        case 'i': idle = atoi(optarg); break;
+        case 'p': pid = atoi(optarg); break;
+        case 'j': json = 1; break;
+        default:
+            fprintf(stderr, "usage: %s [-c connections] [-n lines] [-s size] [-r readers] [-i idle] "
+                    "[-p server pid] [-j] [host]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc)
+        host = argv[optind];
+    if (connections < 1 || lines < 1 || line_size < 32) {
+        fprintf(stderr, "need at least 1 connection, 1 line and 32 byte lines\n");
+        return 1;
+    }
+
+    struct client *clients = calloc(connections, sizeof(*clients));
+    double *latency = calloc((size_t)connections * lines, sizeof(*latency));
+    int *idle_fds = calloc(idle > 0 ? idle : 1, sizeof(*idle_fds));
+    struct reader *reader = calloc(readers > 0 ? readers : 1, sizeof(*reader));
+    if (!clients || !latency || !idle_fds || !reader)
+        return 1;
+
+    if (idle > 0) {
+        int opened = open_idle(idle_fds, idle);
+        if (opened < idle) {
+            fprintf(stderr, "only %d of %d idle connections opened\n", opened, idle);
+            return 1;
+        }
+        // Let the server take them all before measuring
+        sleep(1);
+    }
+
+    atomic_store(&sending, 1);
+    for (int i = 0; i < readers; i++)
+        pthread_create(&reader[i].thread, NULL, th_reader, &reader[i]);
+
+    double cpu_start = pid ? cpu_seconds(pid) : -1;
+    double start = now_sec();
+    for (int i = 0; i < connections; i++) {
+        clients[i].id = i;
+        clients[i].latency = latency + (size_t)i * lines;
+        pthread_create(&clients[i].thread, NULL, th_client, &clients[i]);
+    }
+    int failed = 0;
+    unsigned long long received = 0;
+    for (int i = 0; i < connections; i++) {
+        pthread_join(clients[i].thread, NULL);
+        failed |= clients[i].failed;
+        received += clients[i].received;
+    }
+    double elapsed = now_sec() - start;
+    double cpu_end = pid ? cpu_seconds(pid) : -1;
+    unsigned long replies = 0;
+    unsigned long long bytes = 0;
+    atomic_store(&sending, 0);
+    for (int i = 0; i < readers; i++) {
+        pthread_join(reader[i].thread, NULL);
+        failed |= reader[i].failed;
+        replies += reader[i].replies;
+        bytes += reader[i].bytes;
+    }
+    if (failed) {
+        fprintf(stderr, "a connection failed\n");
+        return 1;
+    }
+
+    size_t total = (size_t)connections * lines;
+    double sent = (double)total * line_size;
+    double cpu = cpu_start >= 0 && cpu_end >= 0 ? cpu_end - cpu_start : -1;
+    unsigned long rss, threads;
+    int memory = pid && read_memory(pid, &rss, &threads) == 0;
+    qsort(latency, total, sizeof(*latency), compare_double);
+    double p50 = latency[total / 2] * 1e6;
+    double p99 = latency[total * 99 / 100] * 1e6;
+    double p999 = latency[total * 999 / 1000] * 1e6;
+    if (json) {
+        printf("{\"connections\": %d, \"lines\": %zu, \"line_size\": %d, \"seconds\": %.3f, "
+               "\"lines_per_s\": %.0f, \"sent_bytes_per_s\": %.0f, \"received_bytes_per_s\": %.0f, "
+               "\"latency_us\": {\"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f}",
+               connections, total, line_size, elapsed, total / elapsed, sent / elapsed,
+               received / elapsed, p50, p99, p999);
+        if (readers)
+            printf(", \"readers\": %d, \"reads_per_s\": %.0f, \"read_bytes_per_s\": %.0f",
+                   readers, replies / elapsed, bytes / elapsed);
+        if (cpu >= 0)
+            printf(", \"server_cpu_s\": %.2f, \"server_cpu_us_per_line\": %.1f",
+                   cpu, cpu / total * 1e6);
+        if (memory)
+            printf(", \"server_rss_kb\": %lu, \"server_threads\": %lu", rss, threads);
+        printf("}\n");
+    } else {
+        printf("%zu lines in %.2f s: %.0f lines/s, latency p50 %.1f us, p99 %.1f us, p999 %.1f us\n",
+               total, elapsed, total / elapsed, p50, p99, p999);
+        printf("sent %.1f MB/s, received %.1f MB/s\n", sent / elapsed / 1e6,
+               received / elapsed / 1e6);
+        if (readers)
+            printf("%d readers: %.0f whole file reads/s, %.1f MB/s\n", readers,
+                   replies / elapsed, bytes / elapsed / 1e6);
+        if (cpu >= 0)
+            printf("server CPU %.2f s, %.1f us per line\n", cpu, cpu / total * 1e6);
+        if (memory)
+            printf("server RSS %lu kB, %lu threads\n", rss, threads);
+    }
+    for (int i = 0; i < idle; i++)
+        close(idle_fds[i]);
+    free(idle_fds);
+    free(reader);
+    free(latency);
+    free(clients);
+    return 0;
+}
@@ -0,0 +1,180 @@
+/**
+ * @file aesdsocket-long-stream.c
+ * @brief Regression check for the aesdsocket receive ring: sends more data
+ * than the ring may ever hold as short lines on one connection, while reading
+ * the replies, and checks that every line comes back.
+ *
+ * Start the server on an empty data file, with "-s none" unless syncing every
+ * line is to be measured as well, then run
+ *   aesdsocket-long-stream [-m megabytes] [-s size] [-p server pid] [host]
+ * Defaults to 40 MiB of 16 byte lines to localhost. The connection uses tail
+ * replies, so what comes back is the lines in the order they were sent, with
+ * the timestamp lines of the server in between. Exits with 0 when every line
+ * came back.
+ * With -p the server is stopped for a few seconds while the lines are sent, so
+ * that, as behind a busy server, more than the ring may hold is waiting in the
+ * socket buffers once it reads again.
+ */
+
+#define _GNU_SOURCE
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define TIMESTAMP_PREFIX "timestamp:"
+
+static const char *host = "localhost";
+static size_t total = 40 << 20;
+static int line_size = 16;
+
+static int connect_server(void)
+{
+    struct addrinfo hints, *res;
+    int fd;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, "9000", &hints, &res) != 0)
+        return -1;
+    fd = socket(res->ai_family, res->ai_socktype, 0);
+    if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+static int send_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t sent = send(fd, buf, len, MSG_NOSIGNAL);
+        if (sent <= 0)
+            return -1;
+        buf += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+/**
+ * Writes line @param i, line_size bytes including the newline, to @param line.
+ */
+static void make_line(char *line, size_t i)
+{
+    int prefix = snprintf(line, line_size, "%zu-", i);
+    memset(line + prefix, 'a' + i % 26, line_size - prefix - 1);
+    line[line_size - 1] = '\n';
+}
+
+/**
+ * Sends all the lines in large writes, without waiting for replies, so the
+ * server always has many complete lines buffered.
+ */
+static void * th_sender(void * arg)
+{
+    int fd = *(int *)arg;
+    size_t batch = 65536 / line_size;
+    char *buf = malloc(batch * line_size);
+    size_t lines = total / line_size;
+
+    for (size_t i = 0; buf && i < lines; ) {
+        size_t n = lines - i < batch ? lines - i : batch;
+        for (size_t j = 0; j < n; j++)
+            make_line(buf + j * line_size, i + j);
+        if (send_all(fd, buf, n * line_size) != 0) {
+            perror("send");
+            break;
+        }
+        i += n;
+    }
+    free(buf);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *mode = "AESDSOCKET_MODE:tail\n";
+    int pid = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:s:p:")) != -1) {
+        switch (opt) {
+        case 'm': total = (size_t)atoi(optarg) << 20; break;
+        case 's': line_size = atoi(optarg); break;
+        case 'p': pid = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-m megabytes] [-s size] [-p server pid] [host]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc)
+        host = argv[optind];
+    if (line_size < 16 || line_size > 255 || total < (size_t)line_size) {
+        fprintf(stderr, "need 16 to 255 byte lines and at least 1 line\n");
+        return 1;
+    }
+
+    int fd = connect_server();
+    if (fd < 0 || send_all(fd, mode, strlen(mode)) != 0) {
+        perror(host);
+        return 1;
+    }
+    pthread_t sender;
+    pthread_create(&sender, NULL, th_sender, &fd);
+    if (pid) {
+        usleep(500000);
+        if (kill(pid, SIGSTOP) == 0) {
+            sleep(4);
+            kill(pid, SIGCONT);
+        }
+    }
+
+    // Compares the replies line by line, a line can end up split between
+    // receives so the partial one is kept at the start of buf
+    size_t lines = total / line_size;
+    size_t next = 0;
+    size_t have = 0;
+    char buf[65536 + 256];
+    char line[256];
+    while (next < lines) {
+        ssize_t len = recv(fd, buf + have, sizeof(buf) - have, 0);
+        if (len <= 0) {
+            fprintf(stderr, "connection %s after %zu of %zu lines\n",
+                    len == 0 ? "closed" : "failed", next, lines);
+            return 1;
+        }
+        have += len;
+        char *p = buf, *end = buf + have, *nl;
+        while ((nl = memchr(p, '\n', end - p))) {
+            size_t n = nl + 1 - p;
+            if (n <= strlen(TIMESTAMP_PREFIX) ||
+                memcmp(p, TIMESTAMP_PREFIX, strlen(TIMESTAMP_PREFIX)) != 0) {
+                make_line(line, next);
+                if (n != (size_t)line_size || memcmp(p, line, n) != 0) {
+                    fprintf(stderr, "line %zu came back as %.*s", next, (int)n, p);
+                    return 1;
+                }
+                next++;
+            }
+            p = nl + 1;
+        }
+        have = end - p;
+        if (have > sizeof(line)) {
+            fprintf(stderr, "line %zu came back without its newline\n", next);
+            return 1;
+        }
+        memmove(buf, p, have);
+    }
+    pthread_join(sender, NULL);
+    close(fd);
+    printf("%zu lines of %d bytes came back\n", lines, line_size);
+    return 0;
+}
@@ -0,0 +1,419 @@
+/**
+ * @file circbuf-bench.c
+ * @brief Times the aesd-circular-buffer.c operations used by the driver.
+ *
+ * The first table compares the offset lookups with the linear walks they
+ * replaced in aesd_read(), aesd_llseek() and aesd_adjust_file_offset(). The
+ * second times aesd_circular_buffer_add_entry() on a full buffer and
+ * aesd_circular_buffer_find_entry_offset_for_fpos() for the access patterns
+ * of the driver's readers: sequential reads of the whole buffer, random
+ * positioned reads and reads of the newest entry, as with tail replies. The
+ * third hands entries from producer threads to one consumer through
+ * struct aesd_lockfree_buffer and through a mutex protected
+ * struct aesd_circular_buffer, checking each producer's entries arrive once
+ * and in order.
+ *
+ * Build with -O2 and run without arguments. Prints one row per number of
+ * stored entries, and per maximum entry size in the second table.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "aesd-circular-buffer.h"
+
+#define MIN_ROUND_LOOKUPS (1UL << 20)
+#define MAX_ROUND_SECONDS 2.0
+#define HANDOFF_ENTRIES (1UL << 21)
+#define HANDOFF_SLOTS 1024
+#define MAX_PRODUCERS 8
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * The lookup previously used by aesd_read(): walk the entries from the oldest
+ * one, subtracting their sizes.
+ */
+static struct aesd_buffer_entry *find_linear(struct aesd_circular_buffer *buffer,
+                                             size_t char_offset, size_t *entry_offset)
+{
+    for (uint32_t i = 0; i < buffer->count; i++) {
+        struct aesd_buffer_entry *entry = aesd_circular_buffer_entry_at(buffer, i);
+        if (entry->size > char_offset) {
+            *entry_offset = char_offset;
+            return entry;
+        }
+        char_offset -= entry->size;
+    }
+    return NULL;
+}
+
+static struct aesd_buffer_entry *find_indexed(struct aesd_circular_buffer *buffer,
+                                              size_t char_offset, size_t *entry_offset)
+{
+    return aesd_circular_buffer_find_entry_offset_for_fpos(buffer, char_offset, entry_offset);
+}
+
+/**
+ * The size computation previously used by aesd_llseek()
+ */
+static size_t size_linear(struct aesd_circular_buffer *buffer)
+{
+    size_t size = 0;
+    for (uint32_t i = 0; i < buffer->count; i++)
+        size += aesd_circular_buffer_entry_at(buffer, i)->size;
+    return size;
+}
+
+static size_t size_indexed(struct aesd_circular_buffer *buffer)
+{
+    return buffer->total_size;
+}
+
+/**
+ * Lookups at pseudo random positions, checking every result against the
+ * expected entry contents.
+ */
+static double run_find(struct aesd_buffer_entry *(*find)(struct aesd_circular_buffer *, size_t, size_t *),
+                       struct aesd_circular_buffer *buffer)
+{
+    size_t rounds = 0;
+    unsigned int seed = 1;
+    double start = now_sec();
+    double elapsed;
+    do {
+        for (size_t r = 0; r < 4096; r++) {
+            size_t offset;
+            size_t fpos = (size_t)rand_r(&seed) % buffer->total_size;
+            struct aesd_buffer_entry *entry = find(buffer, fpos, &offset);
+            if (!entry || entry->buffptr[offset] != (char)('a' + fpos % 26)) {
+                fprintf(stderr, "lookup mismatch at %zu\n", fpos);
+                exit(1);
+            }
+        }
+        rounds += 4096;
+        elapsed = now_sec() - start;
+    } while (rounds < MIN_ROUND_LOOKUPS && elapsed < MAX_ROUND_SECONDS);
+    return elapsed / rounds * 1e9;
+}
+
+static double run_size(size_t (*size)(struct aesd_circular_buffer *),
+                       struct aesd_circular_buffer *buffer)
+{
+    size_t rounds = 0;
+    volatile size_t sink;
+    double start = now_sec();
+    double elapsed;
+    do {
+        for (size_t r = 0; r < 4096; r++)
+            sink = size(buffer);
+        rounds += 4096;
+        elapsed = now_sec() - start;
+    } while (rounds < MIN_ROUND_LOOKUPS && elapsed < MAX_ROUND_SECONDS);
+    (void)sink;
+    return elapsed / rounds * 1e9;
+}
+
+/**
+ * Fills @param buffer with @param entries entries of 1 to 64 bytes, written
+ * twice over so the ring has wrapped. Each byte is 'a' + its position modulo 26
+ * to make lookups checkable.
+ */
+static char *fill(struct aesd_circular_buffer *buffer, uint32_t entries)
+{
+    struct aesd_buffer_entry *storage = calloc(entries, sizeof(*storage));
+    char *data = malloc(2 * (size_t)entries * 64);
+    size_t written = 0;
+    unsigned int seed = entries;
+
+    if (!storage || !data)
+        exit(1);
+    aesd_circular_buffer_init(buffer);
+    aesd_circular_buffer_set_storage(buffer, storage, entries);
+    for (uint32_t i = 0; i < 2 * entries; i++) {
+        struct aesd_buffer_entry entry;
+        if (i == entries)
+            written = 0;
+        entry.buffptr = data + (size_t)(i % entries) * 64;
+        entry.size = 1 + rand_r(&seed) % 64;
+        for (size_t b = 0; b < entry.size; b++)
+            data[(size_t)(i % entries) * 64 + b] = 'a' + (written + b) % 26;
+        written += entry.size;
+        aesd_circular_buffer_add_entry(buffer, &entry);
+    }
+    return data;
+}
+
+/**
+ * Fills @param buffer with @param entries entries of @param max_size / 2 to
+ * max_size bytes, written twice over so the ring has wrapped. The entries all
+ * point at the same bytes, only their sizes matter for the lookups.
+ */
+static void fill_sized(struct aesd_circular_buffer *buffer, uint32_t entries, size_t max_size)
+{
+    struct aesd_buffer_entry *storage = calloc(entries, sizeof(*storage));
+    unsigned int seed = entries;
+
+    if (!storage)
+        exit(1);
+    aesd_circular_buffer_init(buffer);
+    aesd_circular_buffer_set_storage(buffer, storage, entries);
+    for (uint32_t i = 0; i < 2 * entries; i++) {
+        struct aesd_buffer_entry entry;
+        entry.buffptr = "";
+        entry.size = max_size / 2 + rand_r(&seed) % (max_size / 2 + 1);
+        aesd_circular_buffer_add_entry(buffer, &entry);
+    }
+}
+
+/**
+ * Keeps adding entries to the full @param buffer, each overwriting the oldest.
+ */
+static double run_add(struct aesd_circular_buffer *buffer, size_t max_size)
+{
+    size_t rounds = 0;
+    unsigned int seed = 1;
+    double start = now_sec();
+    double elapsed;
+    do {
+        for (size_t r = 0; r < 4096; r++) {
+            struct aesd_buffer_entry entry;
+            entry.buffptr = "";
+            entry.size = max_size / 2 + rand_r(&seed) % (max_size / 2 + 1);
+            aesd_circular_buffer_add_entry(buffer, &entry);
+        }
+        rounds += 4096;
+        elapsed = now_sec() - start;
+    } while (rounds < MIN_ROUND_LOOKUPS && elapsed < MAX_ROUND_SECONDS);
+    return elapsed / rounds * 1e9;
+}
+
+enum pattern { SEQUENTIAL, RANDOM, TAIL };
+
+/**
+ * @return the position the next lookup of @param pattern starts at, after
+ * one at @param fpos found an entry with @param left bytes from there on
+ */
+static size_t next_fpos(enum pattern pattern, struct aesd_circular_buffer *buffer,
+                        size_t fpos, size_t left, unsigned int *seed)
+{
+    size_t tail;
+    switch (pattern) {
+    case SEQUENTIAL:
+        // Like aesd_read(): consume the rest of the entry, then start over
+        fpos += left;
+        return fpos < buffer->total_size ? fpos : 0;
+    case RANDOM:
+        return (size_t)rand_r(seed) % buffer->total_size;
+    case TAIL:
+    default:
+        tail = aesd_circular_buffer_entry_at(buffer, buffer->count - 1)->size;
+        return buffer->total_size - 1 - (size_t)rand_r(seed) % tail;
+    }
+}
+
+/**
+ * Lookups following @param pattern, checking every result lies within the
+ * entry returned.
+ */
+static double run_pattern(enum pattern pattern, struct aesd_circular_buffer *buffer)
+{
+    size_t rounds = 0;
+    size_t fpos = 0;
+    unsigned int seed = 1;
+    double start = now_sec();
+    double elapsed;
+    do {
+        for (size_t r = 0; r < 4096; r++) {
+            size_t offset;
+            struct aesd_buffer_entry *entry =
+                aesd_circular_buffer_find_entry_offset_for_fpos(buffer, fpos, &offset);
+            if (!entry || offset >= entry->size ||
+                aesd_circular_buffer_entry_fpos(buffer, entry) + offset != fpos) {
+                fprintf(stderr, "lookup mismatch at %zu\n", fpos);
+                exit(1);
+            }
+            fpos = next_fpos(pattern, buffer, fpos, entry->size - offset, &seed);
+        }
+        rounds += 4096;
+        elapsed = now_sec() - start;
+    } while (rounds < MIN_ROUND_LOOKUPS && elapsed < MAX_ROUND_SECONDS);
+    return elapsed / rounds * 1e9;
+}
+
+/**
+ * The entries handed off from producers to the consumer, through either buffer
+ */
+struct handoff {
+    int lockfree;
+    struct aesd_lockfree_buffer lf;
+    pthread_mutex_t mutex;
+    struct aesd_circular_buffer locked;
+    unsigned long per_producer;
+};
+
+static int handoff_add(struct handoff *h, const struct aesd_buffer_entry *entry)
+{
+    int added;
+    if (h->lockfree)
+        return aesd_lockfree_buffer_add_entry(&h->lf, entry);
+    pthread_mutex_lock(&h->mutex);
+    added = !h->locked.full;
+    if (added)
+        aesd_circular_buffer_add_entry(&h->locked, entry);
+    pthread_mutex_unlock(&h->mutex);
+    return added;
+}
+
+static int handoff_pop(struct handoff *h, struct aesd_buffer_entry *removed)
+{
+    int popped;
+    if (h->lockfree)
+        return aesd_lockfree_buffer_pop_entry(&h->lf, removed);
+    pthread_mutex_lock(&h->mutex);
+    popped = aesd_circular_buffer_pop_entry(&h->locked, removed);
+    pthread_mutex_unlock(&h->mutex);
+    return popped;
+}
+
+struct producer {
+    pthread_t thread;
+    struct handoff *h;
+    size_t id;
+};
+
+/**
+ * Entries point at the byte of their producer, the locked buffer overwrites
+ * the offset member
+ */
+static char producer_tag[MAX_PRODUCERS];
+
+/**
+ * Adds per_producer entries carrying a sequence number in size, yielding
+ * while the buffer is full.
+ */
+static void * th_producer(void * arg)
+{
+    struct producer *p = arg;
+    struct aesd_buffer_entry entry = { &producer_tag[p->id], 0, 0 };
+
+    for (unsigned long i = 0; i < p->h->per_producer; i++) {
+        entry.size = i;
+        while (!handoff_add(p->h, &entry))
+            sched_yield();
+    }
+    return NULL;
+}
+
+/**
+ * @return nanoseconds per entry handed from @param producers threads to this
+ * one, which checks that the entries of each producer arrive in order.
+ */
+static double run_handoff(int lockfree, int multi_producer, size_t producers)
+{
+    static struct aesd_lockfree_slot lf_slots[HANDOFF_SLOTS];
+    static struct aesd_buffer_entry locked_slots[HANDOFF_SLOTS];
+    static struct handoff h;
+    struct producer p[MAX_PRODUCERS];
+    size_t expected[MAX_PRODUCERS] = { 0 };
+    unsigned long total = HANDOFF_ENTRIES / producers * producers;
+
+    h.lockfree = lockfree;
+    h.per_producer = HANDOFF_ENTRIES / producers;
+    aesd_lockfree_buffer_init(&h.lf, lf_slots, HANDOFF_SLOTS, multi_producer);
+    pthread_mutex_init(&h.mutex, NULL);
+    aesd_circular_buffer_init(&h.locked);
+    aesd_circular_buffer_set_storage(&h.locked, locked_slots, HANDOFF_SLOTS);
+
+    double start = now_sec();
+    for (size_t i = 0; i < producers; i++) {
+        p[i].h = &h;
+        p[i].id = i;
+        pthread_create(&p[i].thread, NULL, th_producer, &p[i]);
+    }
+    for (unsigned long n = 0; n < total; ) {
+        struct aesd_buffer_entry entry;
+        if (!handoff_pop(&h, &entry)) {
+            sched_yield();
+            continue;
+        }
+        size_t id = entry.buffptr - producer_tag;
+        if (id >= producers || entry.size != expected[id]++) {
+            fprintf(stderr, "handoff out of order: producer %zu entry %zu\n",
+                    id, entry.size);
+            exit(1);
+        }
+        n++;
+    }
+    double elapsed = now_sec() - start;
+    for (size_t i = 0; i < producers; i++)
+        pthread_join(p[i].thread, NULL);
+    if (lockfree ? aesd_lockfree_buffer_count(&h.lf) : h.locked.count) {
+        fprintf(stderr, "entries left over after handoff\n");
+        exit(1);
+    }
+    pthread_mutex_destroy(&h.mutex);
+    return elapsed / total * 1e9;
+}
+
+int main(void)
+{
+    const uint32_t counts[] = { 10, 1000, 100000 };
+    const size_t sizes[] = { 16, 256, 4096 };
+
+    printf("%8s %12s %12s %12s %12s\n", "entries", "linear find", "binary find",
+           "linear size", "O(1) size");
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        struct aesd_circular_buffer buffer;
+        char *data = fill(&buffer, counts[c]);
+        if (size_linear(&buffer) != buffer.total_size) {
+            fprintf(stderr, "size mismatch\n");
+            return 1;
+        }
+        printf("%8u %9.1f ns %9.1f ns %9.1f ns %9.1f ns\n", counts[c],
+               run_find(find_linear, &buffer), run_find(find_indexed, &buffer),
+               run_size(size_linear, &buffer), run_size(size_indexed, &buffer));
+        struct aesd_buffer_entry removed;
+        while (aesd_circular_buffer_pop_entry(&buffer, &removed))
+            ;
+        free(aesd_circular_buffer_set_storage(&buffer, NULL, 1));
+        free(data);
+    }
+
+    printf("\n%8s %8s %12s %12s %12s %12s\n", "entries", "max size", "add",
+           "sequential", "random", "tail");
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            struct aesd_circular_buffer buffer;
+            fill_sized(&buffer, counts[c], sizes[s]);
+            double add = run_add(&buffer, sizes[s]);
+            printf("%8u %8zu %9.1f ns %9.1f ns %9.1f ns %9.1f ns\n", counts[c], sizes[s],
+                   add, run_pattern(SEQUENTIAL, &buffer), run_pattern(RANDOM, &buffer),
+                   run_pattern(TAIL, &buffer));
+            struct aesd_buffer_entry removed;
+            while (aesd_circular_buffer_pop_entry(&buffer, &removed))
+                ;
+            free(aesd_circular_buffer_set_storage(&buffer, NULL, 1));
+        }
+    }
+
+    const size_t producers[] = { 1, 2, 4, 8 };
+    printf("\n%9s %12s %12s %12s\n", "producers", "mutex", "MPSC", "SPSC");
+    for (size_t c = 0; c < sizeof(producers) / sizeof(producers[0]); c++) {
+        printf("%9zu %9.1f ns %9.1f ns", producers[c], run_handoff(0, 0, producers[c]),
+               run_handoff(1, 1, producers[c]));
+        if (producers[c] == 1)
+            printf(" %9.1f ns", run_handoff(1, 0, 1));
+        printf("\n");
+    }
+    return 0;
+}
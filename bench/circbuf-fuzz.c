@@ -0,0 +1,296 @@
+/**
+ * @file circbuf-fuzz.c
+ * @brief Differential fuzz harness for aesd-circular-buffer.c: runs a
+ * sequence of operations decoded from the input on a buffer and on a naive
+ * reference model, a plain array of entries kept oldest first, and aborts on
+ * the first difference.
+ *
+ * With clang the circbuf-libfuzzer target links LLVMFuzzerTestOneInput()
+ * against libFuzzer. The circbuf-fuzz target runs the same checks without
+ * it:
+ *   circbuf-fuzz [-n inputs] [-s seed] [input file...]
+ * Replays the given files, for example crashes saved by libFuzzer, or else
+ * runs 100000 random inputs.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "aesd-circular-buffer.h"
+
+#define MODEL_MAX_CAPACITY 64
+#define MAX_INPUT 4096
+
+/**
+ * Entry contents are never read, each entry points at its own byte of ids so
+ * entries can be told apart by buffptr.
+ */
+static char ids[1 << 16];
+
+struct model {
+    struct aesd_buffer_entry entry[MODEL_MAX_CAPACITY];
+    uint32_t count;
+    uint32_t capacity;
+    size_t max_bytes;
+    size_t removed_size;
+    uint32_t next_id;
+};
+
+struct input {
+    const uint8_t *data;
+    size_t size;
+};
+
+static uint8_t next_byte(struct input *in)
+{
+    if (!in->size)
+        return 0;
+    in->size--;
+    return *in->data++;
+}
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            abort(); \
+        } \
+    } while (0)
+
+static size_t model_total(const struct model *m)
+{
+    size_t total = 0;
+    for (uint32_t i = 0; i < m->count; i++)
+        total += m->entry[i].size;
+    return total;
+}
+
+static void model_pop(struct model *m, struct aesd_buffer_entry *removed)
+{
+    *removed = m->entry[0];
+    m->removed_size += removed->size;
+    memmove(&m->entry[0], &m->entry[1], --m->count * sizeof(m->entry[0]));
+}
+
+/**
+ * Compares every observable property of @param buffer with @param m.
+ */
+static void check_state(struct aesd_circular_buffer *buffer, const struct model *m)
+{
+    size_t fpos = 0;
+
+    CHECK(buffer->count == m->count);
+    CHECK(buffer->capacity == m->capacity);
+    CHECK(buffer->full == (m->count == m->capacity));
+    CHECK(buffer->in_offs < buffer->capacity && buffer->out_offs < buffer->capacity);
+    CHECK(buffer->in_offs == (buffer->out_offs + buffer->count) % buffer->capacity);
+    CHECK(buffer->total_size == model_total(m));
+    CHECK(buffer->end_offset == m->removed_size + buffer->total_size);
+    for (uint32_t i = 0; i < m->count; i++) {
+        struct aesd_buffer_entry *entry = aesd_circular_buffer_entry_at(buffer, i);
+        CHECK(entry && entry->buffptr == m->entry[i].buffptr);
+        CHECK(entry->size == m->entry[i].size);
+        CHECK(aesd_circular_buffer_entry_fpos(buffer, entry) == fpos);
+        fpos += entry->size;
+    }
+    CHECK(!aesd_circular_buffer_entry_at(buffer, m->count));
+}
+
+/**
+ * Looks up @param fpos in both, the model walking its entries from the oldest
+ */
+static void check_find(struct aesd_circular_buffer *buffer, const struct model *m, size_t fpos)
+{
+    size_t offset = 0, model_offset = fpos;
+    const struct aesd_buffer_entry *expected = NULL;
+    struct aesd_buffer_entry *entry;
+
+    for (uint32_t i = 0; i < m->count; i++) {
+        if (m->entry[i].size > model_offset) {
+            expected = &m->entry[i];
+            break;
+        }
+        model_offset -= m->entry[i].size;
+    }
+    entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, fpos, &offset);
+    if (!expected) {
+        CHECK(!entry);
+        return;
+    }
+    CHECK(entry && entry->buffptr == expected->buffptr);
+    CHECK(offset == model_offset);
+}
+
+static struct aesd_buffer_entry new_entry(struct model *m, struct input *in)
+{
+    struct aesd_buffer_entry entry;
+    entry.buffptr = &ids[m->next_id++ % sizeof(ids)];
+    // Mostly short entries, with empty ones and a few large ones
+    entry.size = next_byte(in);
+    if (entry.size >= 0xf0)
+        entry.size = (entry.size - 0xf0) << 12;
+    entry.offset = 0;
+    return entry;
+}
+
+/**
+ * Sets the capacity as aesd_set_capacity() does: evict down to it, then move
+ * the entries to new storage, the embedded one whenever it is large enough.
+ */
+static void set_capacity(struct aesd_circular_buffer *buffer, struct model *m, uint32_t capacity)
+{
+    struct aesd_buffer_entry removed, expected;
+    struct aesd_buffer_entry *storage = NULL;
+
+    while (m->count > capacity) {
+        model_pop(m, &expected);
+        CHECK(aesd_circular_buffer_pop_entry(buffer, &removed));
+        CHECK(removed.buffptr == expected.buffptr && removed.size == expected.size);
+    }
+    if (capacity > AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
+        storage = malloc(capacity * sizeof(*storage));
+        CHECK(storage);
+        // Stale slots must not leak into the buffer
+        memset(storage, 0xa5, capacity * sizeof(*storage));
+    }
+    free(aesd_circular_buffer_set_storage(buffer, storage, capacity));
+    m->capacity = capacity;
+}
+
+/**
+ * Runs the operations encoded in @param data on a fresh buffer and model.
+ */
+static void run_input(const uint8_t *data, size_t size)
+{
+    struct input in = { data, size };
+    struct aesd_circular_buffer buffer;
+    struct model m;
+    struct aesd_buffer_entry entry, removed, expected;
+    size_t fpos, back, end;
+
+    memset(&m, 0, sizeof(m));
+    m.capacity = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    aesd_circular_buffer_init(&buffer);
+    check_state(&buffer, &m);
+
+    while (in.size) {
+        uint8_t op = next_byte(&in);
+        switch (op % 8) {
+        case 0:
+        case 1:
+            // Add, overwriting the oldest entry when full
+            entry = new_entry(&m, &in);
+            expected.buffptr = NULL;
+            if (m.count == m.capacity)
+                model_pop(&m, &expected);
+            m.entry[m.count++] = entry;
+            CHECK(aesd_circular_buffer_add_entry(&buffer, &entry) == expected.buffptr);
+            break;
+        case 2:
+            // Add the way aesd_add_line() does, within the byte budget
+            entry = new_entry(&m, &in);
+            while (aesd_circular_buffer_needs_evict(&buffer, entry.size)) {
+                CHECK(m.count == m.capacity ||
+                      (m.max_bytes && m.count && model_total(&m) + entry.size > m.max_bytes));
+                model_pop(&m, &expected);
+                CHECK(aesd_circular_buffer_pop_entry(&buffer, &removed));
+                CHECK(removed.buffptr == expected.buffptr && removed.size == expected.size);
+            }
+            CHECK(m.count < m.capacity);
+            CHECK(!m.max_bytes || !m.count || model_total(&m) + entry.size <= m.max_bytes);
+            m.entry[m.count++] = entry;
+            CHECK(!aesd_circular_buffer_add_entry(&buffer, &entry));
+            break;
+        case 3:
+            if (!m.count) {
+                CHECK(!aesd_circular_buffer_pop_entry(&buffer, &removed));
+                break;
+            }
+            model_pop(&m, &expected);
+            CHECK(aesd_circular_buffer_pop_entry(&buffer, &removed));
+            CHECK(removed.buffptr == expected.buffptr && removed.size == expected.size);
+            break;
+        case 4:
+            set_capacity(&buffer, &m, 1 + next_byte(&in) % MODEL_MAX_CAPACITY);
+            break;
+        case 5:
+            m.max_bytes = buffer.max_bytes = (size_t)next_byte(&in) << 4;
+            break;
+        case 6:
+            // Positions around the end of the stored bytes
+            back = next_byte(&in) % 64;
+            end = buffer.total_size + 4;
+            check_find(&buffer, &m, back < end ? end - back : 0);
+            break;
+        default:
+            fpos = next_byte(&in) << 8;
+            fpos |= next_byte(&in);
+            check_find(&buffer, &m, fpos % (buffer.total_size + 1));
+            break;
+        }
+        check_state(&buffer, &m);
+    }
+
+    while (aesd_circular_buffer_pop_entry(&buffer, &removed))
+        ;
+    free(aesd_circular_buffer_set_storage(&buffer, NULL, 1));
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    run_input(data, size);
+    return 0;
+}
+
+#ifndef CIRCBUF_LIBFUZZER
+static int replay(const char *path)
+{
+    uint8_t data[MAX_INPUT];
+    size_t size;
+    FILE *f = fopen(path, "rb");
+
+    if (!f) {
+        perror(path);
+        return 1;
+    }
+    size = fread(data, 1, sizeof(data), f);
+    fclose(f);
+    run_input(data, size);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    uint8_t data[MAX_INPUT];
+    unsigned long inputs = 100000;
+    unsigned int seed = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+        switch (opt) {
+        case 'n': inputs = strtoul(optarg, NULL, 0); break;
+        case 's': seed = strtoul(optarg, NULL, 0); break;
+        default:
+            fprintf(stderr, "usage: %s [-n inputs] [-s seed] [input file...]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind < argc) {
+        int failed = 0;
+        for (int i = optind; i < argc; i++)
+            failed |= replay(argv[i]);
+        return failed;
+    }
+
+    for (unsigned long i = 0; i < inputs; i++) {
+        size_t size = rand_r(&seed) % MAX_INPUT;
+        for (size_t b = 0; b < size; b++)
+            data[b] = rand_r(&seed);
+        run_input(data, size);
+    }
+    printf("%lu inputs checked\n", inputs);
+    return 0;
+}
+#endif
@@ -0,0 +1,122 @@
+/**
+ * @file newline-bench.c
+ * @brief Compares aesd_split_lines() with the byte at a time loops it replaced
+ * in aesd_write() and aesdsocket's stream_process().
+ *
+ * Build with -O2 (and -mavx2 to measure the AVX2 path) and run without
+ * arguments. Prints one row per input size and line length.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "aesd-newline.h"
+
+#define MIN_ROUND_BYTES (64UL * 1024 * 1024)
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * The loop previously used by aesd_write(): one byte per iteration, with the
+ * scan restarting at the beginning of the remaining data after every line.
+ */
+static size_t split_bytewise(const char *buf, size_t len)
+{
+    size_t lines = 0;
+    size_t start = 0;
+    size_t idx = 0;
+    while (start + idx < len) {
+        if (buf[start + idx] != '\n') {
+            idx++;
+            continue;
+        }
+        lines++;
+        start += idx + 1;
+        idx = 0;
+    }
+    return lines;
+}
+
+/**
+ * One memchr() per line, the approach used before the shared routine.
+ */
+static size_t split_memchr(const char *buf, size_t len)
+{
+    size_t lines = 0;
+    const char *end = buf + len;
+    const char *nl;
+    while (buf < end && (nl = memchr(buf, '\n', end - buf)) != NULL) {
+        lines++;
+        buf = nl + 1;
+    }
+    return lines;
+}
+
+static int count_line(void *ctx, const char *line, size_t len)
+{
+    (void)line;
+    (void)len;
+    (*(size_t *)ctx)++;
+    return 0;
+}
+
+static size_t split_shared(const char *buf, size_t len)
+{
+    size_t lines = 0;
+    aesd_split_lines(buf, len, count_line, &lines);
+    return lines;
+}
+
+static void fill(char *buf, size_t len, size_t line_len)
+{
+    for (size_t i = 0; i < len; i++)
+        buf[i] = (i % line_len == line_len - 1) ? '\n' : 'a' + (i % 26);
+}
+
+static double run(size_t (*split)(const char *, size_t), const char *buf,
+                  size_t len, size_t expected)
+{
+    size_t rounds = MIN_ROUND_BYTES / len + 1;
+    double start = now_sec();
+    for (size_t r = 0; r < rounds; r++) {
+        if (split(buf, len) != expected) {
+            fprintf(stderr, "line count mismatch\n");
+            exit(1);
+        }
+    }
+    double elapsed = now_sec() - start;
+    return (double)len * rounds / elapsed / (1024 * 1024);
+}
+
+int main(void)
+{
+    const size_t sizes[] = { 1024, 16 * 1024, 256 * 1024, 4 * 1024 * 1024,
+                             16 * 1024 * 1024 };
+    const size_t line_lens[] = { 16, 4096 };
+    char *buf = malloc(sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]);
+    if (!buf)
+        return 1;
+
+    printf("block %d bytes\n", (int)AESD_NEWLINE_BLOCK);
+    printf("%10s %6s %14s %14s %14s\n", "bytes", "line", "bytewise MB/s",
+           "memchr MB/s", "shared MB/s");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        for (size_t l = 0; l < sizeof(line_lens) / sizeof(line_lens[0]); l++) {
+            fill(buf, sizes[s], line_lens[l]);
+            size_t expected = split_memchr(buf, sizes[s]);
+            printf("%10zu %6zu %14.0f %14.0f %14.0f\n", sizes[s], line_lens[l],
+                   run(split_bytewise, buf, sizes[s], expected),
+                   run(split_memchr, buf, sizes[s], expected),
+                   run(split_shared, buf, sizes[s], expected));
+        }
+    }
+    free(buf);
+    return 0;
+}
@@ -1,14 +1,27 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <bits/time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/file.h>
 #include <sys/ioctl.h>
-#include <sys/select.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/socket.h>
 #include <sys/syslog.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <endian.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
+#include <poll.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,9 +30,20 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <sys/queue.h>
+#ifdef USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
 #include "aesd_ioctl.h"
+#include "aesd-circular-buffer.h"
+#include "aesd-newline.h"
+#include "aesdsocket_frame.h"
 
 int terminated = 0;
+int tail_mode = 0;
+int stop_fd = -1;
+int timer_fd = -1;
 
 const char * targetFile =
   #ifdef USE_AESD_CHAR_DEVICE
@@ -32,6 +56,10 @@ const char * targetFile =
 void handle_signal(int sig) {
   if (sig == SIGTERM || sig == SIGINT) {
     terminated = 1;
+    if (stop_fd >= 0) {
+      uint64_t one = 1;
+      write(stop_fd, &one, sizeof(one));
+    }
   }
 }
 
@@ -70,7 +98,7 @@ int listen_socket(int daemon, struct addrinfo **servinfo) {
     }
   }
 
-  status = listen(socketfd, 5);
+  status = listen(socketfd, SOMAXCONN);
   if (status != 0) {
     syslog(LOG_ERR, "Error listening: %s", strerror(errno));
     return -1;
@@ -79,12 +107,19 @@ int listen_socket(int daemon, struct addrinfo **servinfo) {
   return socketfd;
 }
 
+/*
+ * Waits for and accepts the next connection. Returns 0 when interrupted or
+ * woken by the stop event or the timestamp timer.
+ */
 int wait_for_connection(int socketfd, struct sockaddr_storage * addr) {
-  fd_set read_fds;
-  FD_ZERO(&read_fds);
-  FD_SET(socketfd, &read_fds);
-  int selectres = select(socketfd+1, &read_fds, NULL, NULL, NULL);
-  if (selectres == -1) {
+  // poll() skips the events that are not open
+  struct pollfd fds[3] = {
+    {.fd = socketfd, .events = POLLIN},
+    {.fd = stop_fd, .events = POLLIN},
+    {.fd = timer_fd, .events = POLLIN},
+  };
+  int pollres = poll(fds, 3, -1);
+  if (pollres == -1) {
     if (errno == EINTR) {
       return 0;
     } else {
@@ -92,9 +127,10 @@ int wait_for_connection(int socketfd, struct sockaddr_storage * addr) {
       return -1;
     }
   }
+  if (!(fds[0].revents & POLLIN)) return 0;
 
   socklen_t addr_size;
-  addr_size = sizeof(&addr);
+  addr_size = sizeof(*addr);
 
   int connfd = accept(socketfd, (struct sockaddr *)addr, &addr_size);
   if (connfd == -1) {
@@ -107,265 +143,2429 @@ int wait_for_connection(int socketfd, struct sockaddr_storage * addr) {
   return connfd;
 }
 
-int wait_for_data(int connfd) {
-  fd_set read_fds;
-  FD_ZERO(&read_fds);
-  FD_SET(connfd, &read_fds);
-  int selectres = select(connfd + 1, &read_fds, NULL, NULL, NULL);
-  if (selectres == -1) {
-    if (errno == EINTR) {
-      return 0;
-    } else {
-      syslog(LOG_ERR, "Error waiting for recieve: %s", strerror(errno));
+enum durability {
+  DURABILITY_NONE,
+  DURABILITY_LINE,
+  DURABILITY_GROUP,
+};
+
+/*
+ * The target file with descriptors opened once at startup. Replies are read
+ * from rfd by offset without any lock.
+ *
+ * Appends to a regular file reserve their range by atomically advancing
+ * reserved, pwrite() into it concurrently and then take their turn in
+ * reservation order by advancing sequenced. A written range is published by
+ * advancing committed too, which is the end of the data readers may send. A
+ * range that could not be written is never published and records error, so
+ * nothing after it is published either: readers never send the hole, and
+ * every append from then on fails. The char device picks its own offsets, so
+ * appends to it are serialized by a FIFO ticket lock instead, waiting on
+ * publish_cond for their turn, and the seek_mutex covers the shared file
+ * position used by llseek and the SEEKTO ioctl.
+ *
+ * With batched set every append is handed to th_writer instead, which then
+ * is the only thread writing to wfd.
+ */
+struct target {
+  int wfd;
+  int rfd;
+  int is_file;
+
+  _Atomic off_t reserved;
+  off_t sequenced;  // under publish_mutex
+  _Atomic off_t committed;
+  atomic_int error;  // errno of the first append that failed
+  pthread_mutex_t publish_mutex;
+  pthread_cond_t publish_cond;
+
+  unsigned int next_ticket;  // under publish_mutex
+  unsigned int now_serving;
+  pthread_mutex_t seek_mutex;
+
+  int batched;
+
+  enum durability durability;
+  unsigned int group_lines;
+  unsigned int group_ms;
+
+  pthread_mutex_t sync_mutex;
+  pthread_cond_t sync_cond;
+  unsigned int pending;
+  pthread_t syncer;
+};
+
+struct target target = {
+  .wfd = -1,
+  .rfd = -1,
+  .publish_mutex = PTHREAD_MUTEX_INITIALIZER,
+  .publish_cond = PTHREAD_COND_INITIALIZER,
+  .seek_mutex = PTHREAD_MUTEX_INITIALIZER,
+  .durability = DURABILITY_LINE,
+  .group_lines = 64,
+  .group_ms = 10,
+  .sync_mutex = PTHREAD_MUTEX_INITIALIZER,
+  .sync_cond = PTHREAD_COND_INITIALIZER,
+};
+
+int parse_durability(const char *name, enum durability *durability) {
+  if (strcmp(name, "none") == 0) *durability = DURABILITY_NONE;
+  else if (strcmp(name, "line") == 0) *durability = DURABILITY_LINE;
+  else if (strcmp(name, "group") == 0) *durability = DURABILITY_GROUP;
+  else return -1;
+  return 0;
+}
+
+/*
+ * Group commit: one fdatasync covers every line appended by any connection
+ * since the last one. Runs when group_lines lines are pending or group_ms
+ * milliseconds after the first pending line, whichever comes first.
+ */
+void * th_syncer(void * arg) {
+  struct target *t = (struct target *)arg;
+
+  pthread_mutex_lock(&t->sync_mutex);
+  while (!terminated || t->pending > 0) {
+    if (t->pending == 0) {
+      pthread_cond_wait(&t->sync_cond, &t->sync_mutex);
+      continue;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += t->group_ms / 1000;
+    deadline.tv_nsec += (long)(t->group_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec += 1;
+      deadline.tv_nsec -= 1000000000;
+    }
+    while (!terminated && t->pending < t->group_lines) {
+      if (pthread_cond_timedwait(&t->sync_cond, &t->sync_mutex, &deadline) ==
+          ETIMEDOUT)
+        break;
+    }
+
+    t->pending = 0;
+    pthread_mutex_unlock(&t->sync_mutex);
+    if (fdatasync(t->wfd) == -1)
+      syslog(LOG_ERR, "Error syncing target: %s", strerror(errno));
+    pthread_mutex_lock(&t->sync_mutex);
+  }
+  pthread_mutex_unlock(&t->sync_mutex);
+  return NULL;
+}
+
+int target_open(struct target *t) {
+  t->wfd = open(targetFile, O_CREAT | O_WRONLY | O_CLOEXEC, 0644);
+  if (t->wfd < 0) {
+    syslog(LOG_ERR, "Error opening %s for writing: %s", targetFile,
+           strerror(errno));
+    return -1;
+  }
+  t->rfd = open(targetFile, O_RDONLY | O_CLOEXEC);
+  if (t->rfd < 0) {
+    syslog(LOG_ERR, "Error opening %s for reading: %s", targetFile,
+           strerror(errno));
+    close(t->wfd);
+    return -1;
+  }
+
+  struct stat st;
+  t->is_file = fstat(t->wfd, &st) == 0 && S_ISREG(st.st_mode);
+  if (t->is_file) {
+    atomic_init(&t->reserved, st.st_size);
+    t->sequenced = st.st_size;
+    atomic_init(&t->committed, st.st_size);
+  } else {
+    t->durability = DURABILITY_NONE; // the char device has nothing to sync
+  }
+  // Each batch of th_writer is a group commit already
+  if (t->batched && t->durability == DURABILITY_GROUP)
+    t->durability = DURABILITY_LINE;
+
+  if (t->durability == DURABILITY_GROUP &&
+      pthread_create(&t->syncer, NULL, &th_syncer, (void *)t) != 0) {
+    syslog(LOG_ERR, "Error starting group commit thread, syncing every line");
+    t->durability = DURABILITY_LINE;
+  }
+  return 0;
+}
+
+void target_close(struct target *t) {
+  if (t->durability == DURABILITY_GROUP) {
+    pthread_mutex_lock(&t->sync_mutex);
+    pthread_cond_signal(&t->sync_cond);
+    pthread_mutex_unlock(&t->sync_mutex);
+    pthread_join(t->syncer, NULL);
+  }
+  close(t->wfd);
+  close(t->rfd);
+  t->wfd = t->rfd = -1;
+}
+
+size_t iov_length(const struct iovec *iov, int iovcnt) {
+  size_t len = 0;
+  for (int i = 0; i < iovcnt; i++) len += iov[i].iov_len;
+  return len;
+}
+
+/*
+ * Writes all of iov, at offset when positioned, retrying short writes.
+ */
+int write_all(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+              int positioned) {
+  struct iovec local[iovcnt];
+  memcpy(local, iov, sizeof(local));
+  iov = local;
+
+  while (iovcnt > 0) {
+    ssize_t written = positioned ? pwritev(fd, iov, iovcnt, offset)
+                                 : writev(fd, iov, iovcnt);
+    if (written < 0) {
+      if (errno == EINTR) continue;
       return -1;
     }
+    offset += written;
+    while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      local[iov - local].iov_base = (char *)iov->iov_base + written;
+      local[iov - local].iov_len -= written;
+    }
   }
-  return 1;
+  return 0;
+}
+
+/*
+ * Appends the data described by iov to the char device, one writer at a time
+ * in the order they arrived. Returns the size of the device right after the
+ * append, or -1 with errno set.
+ */
+off_t target_write_device(struct target *t, const struct iovec *iov, int iovcnt) {
+  pthread_mutex_lock(&t->publish_mutex);
+  unsigned int ticket = t->next_ticket++;
+  while (t->now_serving != ticket)
+    pthread_cond_wait(&t->publish_cond, &t->publish_mutex);
+  pthread_mutex_unlock(&t->publish_mutex);
+
+  off_t end = write_all(t->wfd, iov, iovcnt, 0, 0);
+  if (end == -1) {
+    syslog(LOG_ERR, "Error writing to target: %s", strerror(errno));
+  } else {
+    // Still our turn, so nothing else was appended or evicted since
+    pthread_mutex_lock(&t->seek_mutex);
+    end = lseek(t->rfd, 0, SEEK_END);
+    pthread_mutex_unlock(&t->seek_mutex);
+  }
+  int err = errno;
+
+  pthread_mutex_lock(&t->publish_mutex);
+  t->now_serving++;
+  pthread_cond_broadcast(&t->publish_cond);
+  pthread_mutex_unlock(&t->publish_mutex);
+  errno = err;
+  return end;
+}
+
+/*
+ * Appends the data described by iov to the target from the calling thread.
+ * Returns the offset just past the appended data, for the char device as its
+ * offsets were right after the append. Returns -1 with errno set when the data
+ * could not be written, or for a regular file when an earlier append failed.
+ */
+off_t target_write(struct target *t, const struct iovec *iov, int iovcnt) {
+  if (!t->is_file) return target_write_device(t, iov, iovcnt);
+
+  size_t len = iov_length(iov, iovcnt);
+  off_t start = atomic_fetch_add(&t->reserved, (off_t)len);
+  int err = atomic_load(&t->error);
+  if (!err && write_all(t->wfd, iov, iovcnt, start, 1) == -1) {
+    err = errno;
+    syslog(LOG_ERR, "Error writing to target at offset %lld: %s",
+           (long long)start, strerror(err));
+  }
+
+  // Publish in reservation order so readers never see a gap.
+  pthread_mutex_lock(&t->publish_mutex);
+  while (t->sequenced != start)
+    pthread_cond_wait(&t->publish_cond, &t->publish_mutex);
+  t->sequenced = start + (off_t)len;
+  if (!err) err = atomic_load(&t->error);
+  if (!err)
+    atomic_store_explicit(&t->committed, start + (off_t)len, memory_order_release);
+  else if (!atomic_load(&t->error))
+    atomic_store(&t->error, err);
+  pthread_cond_broadcast(&t->publish_cond);
+  pthread_mutex_unlock(&t->publish_mutex);
+
+  if (err) {
+    errno = err;
+    return -1;
+  }
+  return start + len;
+}
+
+/*
+ * Batched appends, used with -b. Threads with a complete line queue a request
+ * pointing at it on a lock free MPSC queue and wait. A single writer thread
+ * drains the queue, appends everything it found with one writev(), syncs once
+ * when the durability asks for it and then wakes the waiting threads, so the
+ * syscall cost is paid per batch rather than per line. The line stays in the
+ * caller's receive buffer until then, nothing is copied.
+ */
+#define WRITER_QUEUE_SLOTS 4096
+
+struct writer_request {
+  const struct iovec *iov;
+  int iovcnt;
+  size_t len;
+  off_t end;
+  int err;
+  atomic_int done;
+};
+
+struct writer {
+  struct target *target;
+  // Entries carry a struct writer_request in buffptr
+  struct aesd_lockfree_buffer queue;
+  struct aesd_lockfree_slot slots[WRITER_QUEUE_SLOTS];
+  int wake_fd;
+  atomic_int sleeping;
+  atomic_int stopping;
+  pthread_mutex_t done_mutex;
+  pthread_cond_t done_cond;
+  pthread_t thread;
+};
+
+struct writer writer = {
+  .wake_fd = -1,
+  .done_mutex = PTHREAD_MUTEX_INITIALIZER,
+  .done_cond = PTHREAD_COND_INITIALIZER,
+};
+
+void writer_wake(struct writer *w) {
+  uint64_t one = 1;
+  write(w->wake_fd, &one, sizeof(one));
+}
+
+/*
+ * Blocks until a request was queued. Producers only signal wake_fd when they
+ * see sleeping set, the fences order that check against the queue check here.
+ * Returns 1 once stopping with nothing left to write.
+ */
+int writer_sleep(struct writer *w) {
+  atomic_store(&w->sleeping, 1);
+  atomic_thread_fence(memory_order_seq_cst);
+  if (aesd_lockfree_buffer_count(&w->queue) != 0) {
+    atomic_store(&w->sleeping, 0);
+    return 0;
+  }
+  if (atomic_load(&w->stopping)) return 1;
+
+  uint64_t count;
+  if (read(w->wake_fd, &count, sizeof(count)) == -1 && errno != EINTR) {
+    syslog(LOG_ERR, "Error waiting for lines to write: %s", strerror(errno));
+    exit(-1);
+  }
+  atomic_store(&w->sleeping, 0);
+  return 0;
+}
+
+/*
+ * Appends a batch of n requests described by iovcnt segments with a single
+ * write, then marks them done once durable.
+ */
+void writer_commit(struct writer *w, struct writer_request **batch, int n,
+                   const struct iovec *iov, int iovcnt) {
+  struct target *t = w->target;
+  size_t len = 0;
+  for (int i = 0; i < n; i++) len += batch[i]->len;
+
+  off_t end = target_write(t, iov, iovcnt);
+  int err = end == -1 ? errno : 0;
+  if (!err && t->durability != DURABILITY_NONE && fdatasync(t->wfd) == -1)
+    syslog(LOG_ERR, "Error syncing target: %s", strerror(errno));
+
+  off_t pos = end - (off_t)len;
+  for (int i = 0; i < n; i++) {
+    pos += batch[i]->len;
+    // The char device may have evicted the start of a large batch already
+    batch[i]->end = err ? -1 : pos > 0 ? pos : 0;
+    batch[i]->err = err;
+    atomic_store_explicit(&batch[i]->done, 1, memory_order_release);
+  }
+  pthread_mutex_lock(&w->done_mutex);
+  pthread_cond_broadcast(&w->done_cond);
+  pthread_mutex_unlock(&w->done_mutex);
+}
+
+void * th_writer(void * arg) {
+  struct writer *w = (struct writer *)arg;
+  static struct writer_request *batch[IOV_MAX];
+  static struct iovec iov[IOV_MAX];
+  struct writer_request *next = NULL;
+
+  for (;;) {
+    int n = 0, iovcnt = 0;
+    for (;;) {
+      struct aesd_buffer_entry entry;
+      if (!next) {
+        if (!aesd_lockfree_buffer_pop_entry(&w->queue, &entry)) break;
+        next = (struct writer_request *)entry.buffptr;
+      }
+      // A request that doesn't fit starts the next batch
+      if (n > 0 && iovcnt + next->iovcnt > IOV_MAX) break;
+      memcpy(&iov[iovcnt], next->iov, next->iovcnt * sizeof(*iov));
+      iovcnt += next->iovcnt;
+      batch[n++] = next;
+      next = NULL;
+    }
+    if (n > 0)
+      writer_commit(w, batch, n, iov, iovcnt);
+    else if (writer_sleep(w))
+      break;
+  }
+  return NULL;
+}
+
+/*
+ * Queues the data described by iov for the writer thread and waits until it
+ * is written and, unless the durability is none, synced. Returns as
+ * target_write().
+ */
+off_t writer_append(struct writer *w, const struct iovec *iov, int iovcnt) {
+  struct writer_request req = {
+    .iov = iov,
+    .iovcnt = iovcnt,
+    .len = iov_length(iov, iovcnt),
+  };
+  atomic_init(&req.done, 0);
+  struct aesd_buffer_entry entry = {.buffptr = (const char *)&req, .size = req.len};
+
+  // Full only with more waiting threads than slots
+  while (!aesd_lockfree_buffer_add_entry(&w->queue, &entry))
+    sched_yield();
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_exchange(&w->sleeping, 0)) writer_wake(w);
+
+  pthread_mutex_lock(&w->done_mutex);
+  while (!atomic_load_explicit(&req.done, memory_order_acquire))
+    pthread_cond_wait(&w->done_cond, &w->done_mutex);
+  pthread_mutex_unlock(&w->done_mutex);
+  if (req.end == -1) errno = req.err;
+  return req.end;
+}
+
+int writer_start(struct writer *w, struct target *t) {
+  w->target = t;
+  aesd_lockfree_buffer_init(&w->queue, w->slots, WRITER_QUEUE_SLOTS, true);
+  w->wake_fd = eventfd(0, EFD_CLOEXEC);
+  if (w->wake_fd == -1) {
+    syslog(LOG_ERR, "Error creating writer event: %s", strerror(errno));
+    return -1;
+  }
+  if (pthread_create(&w->thread, NULL, &th_writer, (void *)w) != 0) {
+    syslog(LOG_ERR, "Error starting writer thread");
+    close(w->wake_fd);
+    w->wake_fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Stops the writer once every queued request is written. No thread may append
+ * anymore.
+ */
+void writer_stop(struct writer *w) {
+  atomic_store(&w->stopping, 1);
+  writer_wake(w);
+  pthread_join(w->thread, NULL);
+  close(w->wake_fd);
+  w->wake_fd = -1;
+}
+
+/*
+ * Appends the data described by iov to the target, through the writer thread
+ * when batching. Returns as target_write().
+ */
+off_t target_append(struct target *t, const struct iovec *iov, int iovcnt) {
+  if (t->batched) return writer_append(&writer, iov, iovcnt);
+  return target_write(t, iov, iovcnt);
+}
+
+/*
+ * Applies the durability policy after a line has been appended to the target.
+ */
+void target_commit(struct target *t) {
+  if (t->batched) return;  // th_writer synced the batch before returning
+  switch (t->durability) {
+    case DURABILITY_LINE:
+      if (fdatasync(t->wfd) == -1)
+        syslog(LOG_ERR, "Error syncing target: %s", strerror(errno));
+      break;
+    case DURABILITY_GROUP:
+      pthread_mutex_lock(&t->sync_mutex);
+      if (t->pending++ == 0 || t->pending >= t->group_lines)
+        pthread_cond_signal(&t->sync_cond);
+      pthread_mutex_unlock(&t->sync_mutex);
+      break;
+    case DURABILITY_NONE:
+      break;
+  }
+}
+
+/*
+ * End of the data readers may send. The char device only reports its size
+ * through llseek on the shared descriptor.
+ */
+off_t target_size(struct target *t) {
+  if (t->is_file)
+    return atomic_load_explicit(&t->committed, memory_order_acquire);
+
+  pthread_mutex_lock(&t->seek_mutex);
+  off_t size = lseek(t->rfd, 0, SEEK_END);
+  pthread_mutex_unlock(&t->seek_mutex);
+  return size;
+}
+
+/*
+ * Applies a SEEKTO on the shared read descriptor. Returns the resulting
+ * offset, or -1 with errno set.
+ */
+off_t target_seekto(struct target *t, uint32_t cmd, uint32_t offset) {
+  struct aesd_seekto seekto = {.write_cmd = cmd, .write_cmd_offset = offset};
+  pthread_mutex_lock(&t->seek_mutex);
+  off_t pos = -1;
+  if (ioctl(t->rfd, AESDCHAR_IOCSEEKTO, &seekto) == 0)
+    pos = lseek(t->rfd, 0, SEEK_CUR);
+  int err = errno;
+  pthread_mutex_unlock(&t->seek_mutex);
+  errno = err;
+  return pos;
 }
 
 const int BUF_SIZE = 256;
 
+/*
+ * Per connection receive buffer: a power of two sized ring that socket data is
+ * received into directly and lines are parsed from in place. It is allocated
+ * on the first receive and only grows when a single line does not fit.
+ */
+#define STREAM_MIN_SIZE 4096
+#define STREAM_MAX_SIZE (16 * 1024 * 1024)
+
 struct stream_data {
-  ssize_t size;
-  ssize_t pos;
-  ssize_t unprocessed;
   char *buf;
+  size_t size;
+  size_t head;     // ring index of the first buffered byte
+  size_t len;      // buffered bytes
+  size_t scanned;  // bytes from head known not to contain a newline
+  size_t line;     // length of the complete line at head including '\n'
 };
 
 void stream_allocate(struct stream_data *stream) {
-  stream->size = BUF_SIZE;
-  stream->pos = 0;
-  stream->buf = (char *)calloc(stream->size, sizeof(char));
-  stream->unprocessed = 0;
+  stream->buf = NULL;
+  stream->size = 0;
+  stream->head = 0;
+  stream->len = 0;
+  stream->scanned = 0;
+  stream->line = 0;
 }
 
 void stream_free(struct stream_data *stream) {
   free(stream->buf);
+  stream_allocate(stream);
 }
 
-void stream_extend_buffer(struct stream_data *stream) {
-  stream->size = stream->size * 2;
-  char *new_buf = (char *)calloc(stream->size, sizeof(char));
-  strncpy(new_buf, stream->buf, stream->pos + stream->unprocessed);
+/*
+ * Splits the len bytes at ring offset from into at most two contiguous
+ * segments. Returns the number of segments.
+ */
+int stream_segments(struct stream_data *stream, size_t from, size_t len,
+                    struct iovec iov[2]) {
+  if (len == 0) return 0;
+  size_t start = (stream->head + from) & (stream->size - 1);
+  size_t first = stream->size - start;
+  iov[0].iov_base = stream->buf + start;
+  if (len <= first) {
+    iov[0].iov_len = len;
+    return 1;
+  }
+  iov[0].iov_len = first;
+  iov[1].iov_base = stream->buf;
+  iov[1].iov_len = len - first;
+  return 2;
+}
+
+int stream_grow(struct stream_data *stream) {
+  size_t size = stream->size ? stream->size * 2 : STREAM_MIN_SIZE;
+  if (size > STREAM_MAX_SIZE) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+  char *buf = (char *)malloc(size);
+  if (!buf) return -1;
+
+  struct iovec iov[2];
+  int cnt = stream_segments(stream, 0, stream->len, iov);
+  size_t copied = 0;
+  for (int i = 0; i < cnt; i++) {
+    memcpy(buf + copied, iov[i].iov_base, iov[i].iov_len);
+    copied += iov[i].iov_len;
+  }
   free(stream->buf);
-  stream->buf = new_buf;
+  stream->buf = buf;
+  stream->size = size;
+  stream->head = 0;
+  return 0;
 }
 
-int stream_has_space(struct stream_data *stream, int len) {
-  return stream->pos + stream->unprocessed + len < stream->size;
+int stream_full(struct stream_data *stream) {
+  return stream->len == stream->size;
 }
 
-void stream_append_data(struct stream_data *stream, char* buf, int len) {
-  while (!stream_has_space(stream, len)) stream_extend_buffer(stream);
-  strncpy(stream->buf + stream->pos + stream->unprocessed, buf, len);
-  stream->unprocessed += len;
+/*
+ * Describes the free space of the ring, growing it first when it is full.
+ * Returns the number of segments, or -1 with errno set. ENOBUFS means the ring
+ * is full of complete lines that have to be handled first. Callers look for a
+ * complete line in a full ring before asking for more space, the ring only
+ * grows for a line longer than it.
+ */
+int stream_space(struct stream_data *stream, struct iovec iov[2]) {
+  if (stream->len == stream->size) {
+    if (stream->line) {
+      errno = ENOBUFS;
+      return -1;
+    }
+    if (stream_grow(stream) == -1) {
+      syslog(LOG_ERR, "Error growing receive buffer: %s", strerror(errno));
+      return -1;
+    }
+  }
+  return stream_segments(stream, stream->len, stream->size - stream->len, iov);
 }
 
-int stream_receive(int connfd, struct stream_data *stream) {
-  char recv_buf[BUF_SIZE];
-  ssize_t recv_len = recv(connfd, (void *)recv_buf, BUF_SIZE, 0); // MSG_WAITALL?
+/*
+ * Receives from the socket straight into the free space of the ring. Returns
+ * the received length, 0 at end of stream, or -1 with errno set as for
+ * stream_space().
+ */
+ssize_t stream_receive(int connfd, struct stream_data *stream) {
+  struct iovec iov[2];
+  int cnt = stream_space(stream, iov);
+  if (cnt == -1) return -1;
+  ssize_t recv_len = readv(connfd, iov, cnt);
   if (recv_len < 0) {
-    syslog(LOG_ERR, "Error receiving: %s", strerror(errno));
-  }
-  if (recv_len == 0) {
-    return 0;
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      syslog(LOG_ERR, "Error receiving: %s", strerror(errno));
   } else {
-    stream_append_data(stream, recv_buf, recv_len);
+    stream->len += recv_len;
   }
-  return 1;
+  return recv_len;
 }
 
+/*
+ * Looks for the next complete line. Bytes already scanned are not scanned
+ * again, so a long line arriving in many pieces is searched once.
+ */
 int stream_process(struct stream_data *stream) {
-  while (stream->unprocessed > 0 && stream->buf[stream->pos] != '\n') {
-    stream->unprocessed -= 1;
-    stream->pos += 1;
+  if (stream->line) return 1;
+
+  struct iovec iov[2];
+  int cnt = stream_segments(stream, stream->scanned,
+                            stream->len - stream->scanned, iov);
+  for (int i = 0; i < cnt; i++) {
+    size_t nl = aesd_find_newline(iov[i].iov_base, iov[i].iov_len);
+    if (nl < iov[i].iov_len) {
+      stream->line = stream->scanned + nl + 1;
+      stream->scanned = stream->line;
+      return 1;
+    }
+    stream->scanned += iov[i].iov_len;
   }
-  return stream->buf[stream->pos] == '\n';
+  return 0;
+}
+
+/*
+ * Describes the current line as at most two segments of the ring.
+ */
+int stream_line_iov(struct stream_data *stream, struct iovec iov[2]) {
+  return stream_segments(stream, 0, stream->line, iov);
+}
+
+/*
+ * Copies the current line without its trailing newline into dst as a NUL
+ * terminated string, truncating it to fit. Used for short command lines.
+ */
+size_t stream_line_copy(struct stream_data *stream, char *dst, size_t size) {
+  struct iovec iov[2];
+  int cnt = stream_segments(stream, 0, stream->line - 1, iov);
+  size_t copied = 0;
+  for (int i = 0; i < cnt && copied < size - 1; i++) {
+    size_t len = iov[i].iov_len;
+    if (len > size - 1 - copied) len = size - 1 - copied;
+    memcpy(dst + copied, iov[i].iov_base, len);
+    copied += len;
+  }
+  dst[copied] = '\0';
+  return copied;
+}
+
+/*
+ * Copies len buffered bytes starting at ring offset from into dst.
+ */
+void stream_peek(struct stream_data *stream, size_t from, void *dst,
+                 size_t len) {
+  struct iovec iov[2];
+  int cnt = stream_segments(stream, from, len, iov);
+  for (int i = 0; i < cnt; i++) {
+    memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+    dst = (char *)dst + iov[i].iov_len;
+  }
+}
+
+/*
+ * Binary connections: looks for the next complete frame, which then is the
+ * current line. The header says how long the frame is, so nothing is scanned
+ * and a payload is received in place however many receives it takes. Returns
+ * -1 with errno set for a header that can't start a frame.
+ */
+int stream_frame(struct stream_data *stream) {
+  if (stream->line) return 1;
+
+  struct aesd_frame_header hdr;
+  if (stream->len < sizeof(hdr)) return 0;
+  stream_peek(stream, 0, &hdr, sizeof(hdr));
+  size_t length = ntohl(hdr.length);
+  if (ntohs(hdr.magic) != AESD_FRAME_MAGIC || length > AESD_FRAME_MAX_PAYLOAD) {
+    errno = EPROTO;
+    return -1;
+  }
+  if (stream->len < sizeof(hdr) + length) return 0;
+  stream->line = sizeof(hdr) + length;
+  stream->scanned = stream->line;
+  return 1;
+}
+
+int stream_line_starts_with(struct stream_data *stream, const char *prefix) {
+  size_t len = strlen(prefix);
+  if (stream->line <= len) return 0;
+
+  struct iovec iov[2];
+  int cnt = stream_segments(stream, 0, len, iov);
+  for (int i = 0; i < cnt; i++) {
+    if (memcmp(iov[i].iov_base, prefix, iov[i].iov_len) != 0) return 0;
+    prefix += iov[i].iov_len;
+  }
+  return 1;
 }
 
 void stream_flush_line(struct stream_data *stream) {
-  strncpy(stream->buf, stream->buf + stream->pos+1, stream->unprocessed);
-  stream->pos = 0;
+  stream->head = (stream->head + stream->line) & (stream->size - 1);
+  stream->len -= stream->line;
+  stream->scanned -= stream->line;
+  stream->line = 0;
+  if (stream->len == 0) stream->head = 0;
 }
 
-void stream_write(struct stream_data *stream, int fd) {
-  write(fd, stream->buf, stream->pos+1);
+/*
+ * Appends the line at the head of the stream to the target and drops it from
+ * the stream. Returns as target_append().
+ */
+off_t stream_write(struct stream_data *stream, struct target *t) {
+  struct iovec iov[2];
+  int cnt = stream_line_iov(stream, iov);
+  off_t end = target_append(t, iov, cnt);
   stream_flush_line(stream);
+  return end;
 }
 
 const char* CMD_SEEKTO = "AESDCHAR_IOCSEEKTO:";
 
-void stream_seekto(struct stream_data *stream, int fd) {
+/*
+ * Applies the SEEKTO command on the shared read descriptor and returns the
+ * resulting offset to reply from.
+ */
+off_t stream_seekto(struct stream_data *stream, struct target *t) {
+  char line[64];
+  stream_line_copy(stream, line, sizeof(line));
+
   char * endp;
-  int cmd = strtol(stream->buf + strlen(CMD_SEEKTO), &endp, 10);
+  int cmd = strtol(line + strlen(CMD_SEEKTO), &endp, 10);
   int offset = strtol(endp+1, &endp, 10);
 
-  struct aesd_seekto seekto = {.write_cmd = cmd, .write_cmd_offset = offset};
-  ioctl(fd, AESDCHAR_IOCSEEKTO, &seekto);
+  off_t pos = target_seekto(t, cmd, offset);
   stream_flush_line(stream);
+  return pos < 0 ? 0 : pos;
 }
 
-const int STREAM_LINE_TYPE_DATA = 0;
-const int STREAM_LINE_TYPE_SEEKTO = 1;
+/*
+ * Selects how replies are built for a connection: the whole target after every
+ * line, or only what was appended since the previous reply.
+ */
+const char* CMD_MODE = "AESDSOCKET_MODE:";
+const char* MODE_FULL = "full";
+const char* MODE_TAIL = "tail";
+const char* MODE_BINARY = "binary";
+
+enum {
+  STREAM_LINE_TYPE_DATA = 0,
+  STREAM_LINE_TYPE_SEEKTO = 1,
+  STREAM_LINE_TYPE_MODE = 2,
+  STREAM_LINE_TYPE_FRAME = 3,  // binary request answered without appending
+  STREAM_LINE_TYPE_FAILED = 4,  // the line could not be appended
+};
 
 
 int stream_line_type(struct stream_data *stream) {
-  if (stream->pos >= strlen(CMD_SEEKTO) &&
-      strncmp(stream->buf, CMD_SEEKTO, strlen(CMD_SEEKTO)) == 0) {
+  if (stream_line_starts_with(stream, CMD_SEEKTO)) {
     return STREAM_LINE_TYPE_SEEKTO;
   }
+  if (stream_line_starts_with(stream, CMD_MODE)) {
+    return STREAM_LINE_TYPE_MODE;
+  }
   return STREAM_LINE_TYPE_DATA;
 }
 
-void send_data(int fdTarget, int fdSource) {
-  char send_buf[256];
-  ssize_t send_len = read(fdSource, send_buf, 256);
-  if (send_len < 0) {
-    syslog(LOG_ERR, "Error while reading from temp file: %s", strerror(errno));
-    exit(-1);
+enum reply_mode {
+  REPLY_MODE_SENDFILE,
+  REPLY_MODE_SPLICE,
+  REPLY_MODE_COPY,
+};
+
+/*
+ * A reply is the range of fd from offset to end, preceded by the frame header
+ * and small payload in head on binary connections. The pipe splice() goes
+ * through is created by the first reply that needs it and reused by the
+ * following replies on the same connection.
+ */
+struct reply {
+  int fd;
+  off_t offset;
+  off_t end;
+  enum reply_mode mode;
+  int pipefd[2];
+  size_t piped;
+  char head[sizeof(struct aesd_frame_header) + sizeof(uint64_t)];
+  size_t head_len;
+  size_t head_sent;
+};
+
+void reply_reset(struct reply *reply) {
+  reply->fd = -1;
+  reply->offset = 0;
+  reply->end = 0;
+  reply->mode = REPLY_MODE_COPY;
+  reply->piped = 0;
+  reply->head_len = 0;
+  reply->head_sent = 0;
+}
+
+void reply_init(struct reply *reply) {
+  reply->pipefd[0] = reply->pipefd[1] = -1;
+  reply_reset(reply);
+}
+
+void reply_close_pipe(struct reply *reply) {
+  if (reply->pipefd[0] >= 0) close(reply->pipefd[0]);
+  if (reply->pipefd[1] >= 0) close(reply->pipefd[1]);
+  reply->pipefd[0] = reply->pipefd[1] = -1;
+}
+
+/*
+ * Puts a frame header with the given length in front of the reply, followed by
+ * the payload_len bytes at payload. The rest of the frame, if any, is the range
+ * set with reply_begin().
+ */
+void reply_frame(struct reply *reply, uint8_t type, uint8_t flags,
+                 uint32_t sequence, uint32_t length, const void *payload,
+                 size_t payload_len) {
+  struct aesd_frame_header hdr = {
+    .magic = htons(AESD_FRAME_MAGIC),
+    .type = type,
+    .flags = flags,
+    .length = htonl(length),
+    .sequence = htonl(sequence),
+  };
+  memcpy(reply->head, &hdr, sizeof(hdr));
+  memcpy(reply->head + sizeof(hdr), payload, payload_len);
+  reply->head_len = sizeof(hdr) + payload_len;
+  reply->head_sent = 0;
+}
+
+/*
+ * Snapshots the range of fd from offset to end, which send_data() then streams
+ * to the client. The descriptor stays owned by the caller. Regular files are
+ * sent with sendfile(), anything else (/dev/aesdchar) is spliced through a
+ * pipe.
+ */
+void reply_begin(struct reply *reply, int fd, off_t offset, off_t end) {
+  reply->fd = fd;
+  reply->offset = offset;
+  reply->end = end;
+  if (reply->offset < 0 || reply->end < reply->offset) {
+    reply->offset = 0;
+    reply->end = 0;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    reply->mode = REPLY_MODE_SENDFILE;
+  } else if (reply->pipefd[0] >= 0 ||
+             pipe2(reply->pipefd, O_NONBLOCK | O_CLOEXEC) == 0) {
+    reply->mode = REPLY_MODE_SPLICE;
+  } else {
+    reply->mode = REPLY_MODE_COPY;
+  }
+}
+
+/*
+ * Ends the reply, keeping the pipe for the next one unless bytes of this one
+ * are still in it.
+ */
+void reply_end(struct reply *reply) {
+  if (reply->piped > 0) reply_close_pipe(reply);
+  reply_reset(reply);
+}
+
+void reply_free(struct reply *reply) {
+  reply_close_pipe(reply);
+  reply_reset(reply);
+}
+
+int zero_copy_unsupported(int err) {
+  return err == EINVAL || err == ENOSYS || err == EOPNOTSUPP;
+}
+
+/*
+ * Moves the next chunk of the reply to the socket. Returns the number of bytes
+ * the reply advanced by, 0 at the end of the source, or -1 with errno set.
+ */
+ssize_t send_chunk(int connfd, struct reply *reply) {
+  size_t remaining = reply->end - reply->offset;
+
+  switch (reply->mode) {
+    case REPLY_MODE_SENDFILE:
+      return sendfile(connfd, reply->fd, &reply->offset, remaining);
+
+    case REPLY_MODE_SPLICE: {
+      if (reply->piped == 0) {
+        ssize_t len = splice(reply->fd, &reply->offset, reply->pipefd[1], NULL,
+                             remaining, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (len <= 0) return len;
+        reply->piped = len;
+      }
+      ssize_t sent = splice(reply->pipefd[0], NULL, connfd, NULL, reply->piped,
+                            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (sent > 0) reply->piped -= sent;
+      return sent;
+    }
+
+    case REPLY_MODE_COPY:
+    default: {
+      char send_buf[BUF_SIZE * 16];
+      if (remaining > sizeof(send_buf)) remaining = sizeof(send_buf);
+      ssize_t len = pread(reply->fd, send_buf, remaining, reply->offset);
+      if (len <= 0) return len;
+
+      ssize_t sent = send(connfd, send_buf, len, MSG_NOSIGNAL);
+      if (sent > 0) reply->offset += sent;
+      return sent;
+    }
   }
-  while (send_len > 0) {
-    char msg[257];
-    strncpy(msg, send_buf, send_len);
-    msg[send_len] = '\0';
-    ssize_t total_sent = 0;
-    while (total_sent < send_len) {
-      ssize_t sent =
-          send(fdTarget, send_buf + total_sent, send_len - total_sent, 0);
-      total_sent += sent;
-    }
-    send_len = read(fdSource, send_buf, 256);
-    if (send_len < 0) {
-      syslog(LOG_ERR, "Error while reading from temp file: %s",
+}
+
+/*
+ * Sends the pending reply. Returns 1 once the whole reply has been sent, 0 if
+ * the socket is non-blocking and would block (call again when writable), and
+ * -1 on error. Falls back to read/send when the zero copy path is not
+ * supported by the source or the socket.
+ */
+int send_data(int connfd, struct reply *reply) {
+  while (reply->head_sent < reply->head_len) {
+    // Held back until the range is sent too, when there is one
+    int more = reply->offset < reply->end ? MSG_MORE : 0;
+    ssize_t sent = send(connfd, reply->head + reply->head_sent,
+                        reply->head_len - reply->head_sent, MSG_NOSIGNAL | more);
+    if (sent > 0) {
+      reply->head_sent += sent;
+      continue;
+    }
+    if (errno == EINTR) continue;
+    if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+    syslog(LOG_ERR, "Error sending reply header: %s", strerror(errno));
+    reply_end(reply);
+    return -1;
+  }
+
+  while (reply->offset < reply->end || reply->piped > 0) {
+    ssize_t sent = send_chunk(connfd, reply);
+    if (sent > 0) continue;
+    if (sent == 0) break;
+
+    if (errno == EINTR) continue;
+    if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+    if (reply->mode != REPLY_MODE_COPY && reply->piped == 0 &&
+        zero_copy_unsupported(errno)) {
+      syslog(LOG_DEBUG, "Zero copy reply not supported (%s), using read/send",
              strerror(errno));
-      exit(-1);
+      reply->mode = REPLY_MODE_COPY;
+      continue;
     }
+    syslog(LOG_ERR, "Error sending reply at offset %lld of %lld: %s",
+           (long long)reply->offset, (long long)reply->end, strerror(errno));
+    reply_end(reply);
+    return -1;
+  }
+  if (reply->offset < reply->end) {
+    syslog(LOG_WARNING, "Reply truncated at offset %lld of %lld",
+           (long long)reply->offset, (long long)reply->end);
+    // The frame header promised more, the client can't find the next one
+    if (reply->head_len) {
+      reply_end(reply);
+      return -1;
+    }
+  }
+  reply_end(reply);
+  return 1;
+}
+
+struct connection {
+  int connfd;
+  struct sockaddr_storage conn_addr;
+  struct stream_data stream;
+  struct reply reply;
+  int tail;
+  off_t sent_offset;
+  int eof;
+  int binary;  // framed with struct aesd_frame_header instead of lines
+  struct aesd_frame_read reads[AESD_FRAME_MAX_READS];  // of a READ request
+  unsigned nreads;
+  unsigned next_read;
+  uint32_t read_sequence;
+  LIST_ENTRY(connection) list;
+};
+
+void connection_init(struct connection *conn, int connfd,
+                     struct sockaddr_storage *conn_addr) {
+  conn->connfd = connfd;
+  conn->conn_addr = *conn_addr;
+  stream_allocate(&conn->stream);
+  reply_init(&conn->reply);
+  conn->tail = tail_mode;
+  conn->sent_offset = 0;
+  conn->eof = 0;
+  conn->binary = 0;
+  conn->nreads = 0;
+  conn->next_read = 0;
+}
+
+void connection_free(struct connection *conn) {
+  reply_free(&conn->reply);
+  stream_free(&conn->stream);
+}
+
+/*
+ * Switches the connection between full and tail replies. In tail mode only the
+ * bytes past the end of the previous reply are sent. Tail replies need offsets
+ * that stay put, which only a regular file has: /dev/aesdchar counts them from
+ * the oldest retained write, so they move whenever a write is evicted. There a
+ * request for tail replies is refused and the connection keeps full replies.
+ */
+void stream_mode(struct stream_data *stream, struct connection *conn) {
+  char line[64];
+  size_t len = stream_line_copy(stream, line, sizeof(line)) - strlen(CMD_MODE);
+  const char *mode = line + strlen(CMD_MODE);
+  if (len > 0 && mode[len - 1] == '\r') len--;
+
+  if (len == strlen(MODE_TAIL) && strncmp(mode, MODE_TAIL, len) == 0) {
+    if (target.is_file)
+      conn->tail = 1;
+    else
+      syslog(LOG_WARNING, "Tail replies need a regular file, sending full "
+             "replies to %s",
+             inet_ntoa(((struct sockaddr_in *)&conn->conn_addr)->sin_addr));
+  } else if (len == strlen(MODE_FULL) && strncmp(mode, MODE_FULL, len) == 0) {
+    conn->tail = 0;
+  } else if (len == strlen(MODE_BINARY) &&
+             strncmp(mode, MODE_BINARY, len) == 0) {
+    conn->binary = 1;
+  } else {
+    syslog(LOG_WARNING, "Unknown reply mode %.*s", (int)len, mode);
+  }
+  stream_flush_line(stream);
+}
+
+/*
+ * Handles the next unit of a binary connection: the next range of a READ
+ * batch, or else the frame at the head of the stream. Returns its
+ * STREAM_LINE_TYPE like connection_line(), with the reply frame set up in
+ * front of the range from *offset to *end.
+ */
+int connection_frame(struct connection *conn, off_t *offset, off_t *end) {
+  struct reply *reply = &conn->reply;
+  *offset = *end = 0;
+
+  if (conn->next_read < conn->nreads) {
+    struct aesd_frame_read *rd = &conn->reads[conn->next_read++];
+    uint64_t size = target_size(&target);
+    uint64_t start = rd->offset < size ? rd->offset : size;
+    uint64_t len = size - start < rd->length ? size - start : rd->length;
+    *offset = start;
+    *end = start + len;
+    reply_frame(reply, AESD_FRAME_DATA,
+                conn->next_read == conn->nreads ? AESD_FRAME_FLAG_LAST : 0,
+                conn->read_sequence, len, NULL, 0);
+    return STREAM_LINE_TYPE_FRAME;
+  }
+
+  struct aesd_frame_header hdr;
+  stream_peek(&conn->stream, 0, &hdr, sizeof(hdr));
+  size_t length = ntohl(hdr.length);
+  uint32_t sequence = ntohl(hdr.sequence);
+  int type = STREAM_LINE_TYPE_FRAME;
+  uint64_t ack = 0;
+  int err = 0;
+
+  switch (hdr.type) {
+    case AESD_FRAME_APPEND: {
+      // The char device would hold a partial line for whichever write comes
+      // next, from any connection
+      char last = '\n';
+      if (length) stream_peek(&conn->stream, sizeof(hdr) + length - 1, &last, 1);
+      if (!target.is_file && last != '\n') {
+        err = EINVAL;
+        break;
+      }
+      // Straight from the receive buffer
+      struct iovec iov[2];
+      int cnt = stream_segments(&conn->stream, sizeof(hdr), length, iov);
+      off_t end = cnt ? target_append(&target, iov, cnt) : target_size(&target);
+      if (end == -1) {
+        err = errno;
+        break;
+      }
+      ack = end;
+      type = STREAM_LINE_TYPE_DATA;
+      break;
+    }
+    case AESD_FRAME_SEEK: {
+      struct aesd_frame_seek seek;
+      if (length != sizeof(seek)) {
+        err = EINVAL;
+        break;
+      }
+      stream_peek(&conn->stream, sizeof(hdr), &seek, sizeof(seek));
+      off_t pos = target_seekto(&target, ntohl(seek.write_cmd),
+                                ntohl(seek.write_cmd_offset));
+      if (pos < 0) err = errno;
+      else ack = pos;
+      break;
+    }
+    case AESD_FRAME_READ: {
+      size_t n = length / sizeof(conn->reads[0]);
+      if (length % sizeof(conn->reads[0]) || n == 0 || n > AESD_FRAME_MAX_READS) {
+        err = EINVAL;
+        break;
+      }
+      stream_peek(&conn->stream, sizeof(hdr), conn->reads, length);
+      for (size_t i = 0; i < n; i++) {
+        conn->reads[i].offset = be64toh(conn->reads[i].offset);
+        conn->reads[i].length = be64toh(conn->reads[i].length);
+      }
+      conn->nreads = n;
+      conn->next_read = 0;
+      conn->read_sequence = sequence;
+      stream_flush_line(&conn->stream);
+      return connection_frame(conn, offset, end);
+    }
+    default:
+      err = EINVAL;
+      break;
+  }
+  stream_flush_line(&conn->stream);
+
+  if (err) {
+    uint32_t value = htonl(err);
+    reply_frame(reply, AESD_FRAME_ERROR, 0, sequence, sizeof(value), &value,
+                sizeof(value));
+  } else {
+    ack = htobe64(ack);
+    reply_frame(reply, AESD_FRAME_ACK, 0, sequence, sizeof(ack), &ack,
+                sizeof(ack));
+  }
+  return type;
+}
+
+/*
+ * Returns 1 when connection_line() has something to handle: a complete line,
+ * or on binary connections a complete frame or a range of a READ batch still
+ * to send. A malformed frame ends the connection.
+ */
+int connection_next(struct connection *conn) {
+  if (!conn->binary) return stream_process(&conn->stream);
+  if (conn->next_read < conn->nreads) return 1;
+
+  int status = stream_frame(&conn->stream);
+  if (status == -1) {
+    syslog(LOG_ERR, "Invalid frame from %s, closing connection",
+           inet_ntoa(((struct sockaddr_in *)&conn->conn_addr)->sin_addr));
+    conn->eof = 1;
+    return 0;
+  }
+  return status;
+}
+
+/*
+ * Handles the complete line at the head of the stream and returns its
+ * STREAM_LINE_TYPE. Data and SEEKTO lines are answered with the target range
+ * from *offset to *end; appended data still has to go through target_commit()
+ * before the reply is sent. A data line that could not be appended gets no
+ * reply, the connection is to be closed instead.
+ */
+int connection_line(struct connection *conn, off_t *offset, off_t *end) {
+  if (conn->binary) return connection_frame(conn, offset, end);
+
+  int type = stream_line_type(&conn->stream);
+  switch (type) {
+    case STREAM_LINE_TYPE_DATA:
+      if (stream_write(&conn->stream, &target) == -1) {
+        syslog(LOG_ERR, "Could not append a line from %s, closing connection",
+               inet_ntoa(((struct sockaddr_in *)&conn->conn_addr)->sin_addr));
+        return STREAM_LINE_TYPE_FAILED;
+      }
+      // Only set on a regular file, see stream_mode()
+      *offset = conn->tail ? conn->sent_offset : 0;
+      break;
+    case STREAM_LINE_TYPE_SEEKTO:
+      *offset = stream_seekto(&conn->stream, &target);
+      break;
+    case STREAM_LINE_TYPE_MODE:
+      stream_mode(&conn->stream, conn);
+      return type;
+  }
+  *end = target_size(&target);
+  // An empty reply when the target shrank below the offset
+  if (*offset < 0 || *end < *offset) *offset = *end = 0;
+  conn->sent_offset = *end;
+  return type;
+}
+
+/*
+ * Handles every complete line buffered for the connection, sending the target
+ * contents back after each one. Returns 1 when all lines are handled, 0 when a
+ * reply is still pending on a non-blocking socket and -1 on error.
+ */
+int connection_process(struct connection *conn) {
+  int status = 1;
+  if (conn->reply.fd >= 0)
+    status = send_data(conn->connfd, &conn->reply);
+
+  while (status == 1 && connection_next(conn)) {
+    off_t offset, end;
+    int type = connection_line(conn, &offset, &end);
+    if (type == STREAM_LINE_TYPE_MODE) continue;
+    if (type == STREAM_LINE_TYPE_FAILED) return -1;
+    if (type == STREAM_LINE_TYPE_DATA) target_commit(&target);
+
+    reply_begin(&conn->reply, target.rfd, offset, end);
+    status = send_data(conn->connfd, &conn->reply);
   }
+  return status;
 }
 
 typedef struct {
   int connfd;
-  int done;
   struct sockaddr_storage conn_addr;
-  pthread_mutex_t *mutex;
 } thread_data_t;
 
-typedef struct tl_entry {
-  pthread_t thread;
-  thread_data_t tdata;
-  SLIST_ENTRY(tl_entry) list;
-} tl_entry_t;
+/*
+ * Timestamp lines appended to the data file every interval seconds. A timerfd
+ * drives them, polled by the event loops next to their other descriptors:
+ * whichever loop reads an expiration first appends the line through
+ * target_append() like client data, the others find the timer already read.
+ * The line is formatted once per second at most and reused within it. Not
+ * used with /dev/aesdchar.
+ */
+#define TIMESTAMP_PREFIX "timestamp:"
+
+struct timestamp {
+  unsigned int interval;
+  const char *format;
+  pthread_mutex_t mutex;
+  time_t formatted;  // second the cached line was formatted for
+  char line[256];
+  size_t len;
+};
 
-SLIST_HEAD(tl_list, tl_entry);
+struct timestamp timestamp = {
+  .interval = 10,
+  .format = "%a, %d %b %Y %T %z",
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+  .formatted = -1,
+};
 
-void * th_listen(void * arg) {
-  thread_data_t *data = (thread_data_t *)arg;
+int timestamp_open(struct timestamp *ts) {
+#ifndef USE_AESD_CHAR_DEVICE
+  timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (timer_fd == -1) {
+    syslog(LOG_ERR, "Error creating timestamp timer: %s", strerror(errno));
+    return -1;
+  }
+  struct itimerspec spec = {
+    .it_interval = {.tv_sec = ts->interval},
+    .it_value = {.tv_sec = ts->interval},
+  };
+  if (timerfd_settime(timer_fd, 0, &spec, NULL) == -1) {
+    syslog(LOG_ERR, "Error starting timestamp timer: %s", strerror(errno));
+    close(timer_fd);
+    timer_fd = -1;
+    return -1;
+  }
+#else
+  (void)ts;
+#endif
+  return 0;
+}
 
-  struct stream_data stream;
-  stream_allocate(&stream);
+void timestamp_close(void) {
+  if (timer_fd >= 0) close(timer_fd);
+  timer_fd = -1;
+}
 
-  int client_eof = 0;
-  while (!client_eof && !terminated) {
-    int status = wait_for_data(data->connfd);
-    if (status == -1)
-      exit(-1);
-    else if (status == 0)
+/*
+ * Appends a timestamp line if the timer expired. Missed expirations are
+ * folded into one line.
+ */
+void timestamp_tick(struct timestamp *ts) {
+  uint64_t expirations;
+  if (timer_fd < 0 ||
+      read(timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+    return;
+
+  char line[sizeof(ts->line)];
+  time_t now = time(NULL);
+  pthread_mutex_lock(&ts->mutex);
+  if (now != ts->formatted) {
+    struct tm nowtm;
+    size_t prefix = strlen(TIMESTAMP_PREFIX);
+    memcpy(ts->line, TIMESTAMP_PREFIX, prefix);
+    size_t size = strftime(ts->line + prefix, sizeof(ts->line) - prefix - 1,
+                           ts->format, gmtime_r(&now, &nowtm));
+    ts->line[prefix + size] = '\n';
+    ts->len = prefix + size + 1;
+    ts->formatted = now;
+  }
+  size_t len = ts->len;
+  memcpy(line, ts->line, len);
+  pthread_mutex_unlock(&ts->mutex);
+
+  // One append so the prefix and date can't be split by another writer.
+  struct iovec iov = {.iov_base = line, .iov_len = len};
+  target_append(&target, &iov, 1);
+  target_commit(&target);
+}
+
+LIST_HEAD(connection_list, connection);
+
+typedef struct {
+  int socketfd;
+} reactor_data_t;
+
+static char REACTOR_TAG_LISTEN, REACTOR_TAG_STOP, REACTOR_TAG_TIMER;
+
+void reactor_close(struct connection *conn) {
+  LIST_REMOVE(conn, list);
+  close(conn->connfd);
+  connection_free(conn);
+  syslog(LOG_INFO, "Closed connection from %s",
+         inet_ntoa(((struct sockaddr_in *)&(conn->conn_addr))->sin_addr));
+  free(conn);
+}
+
+void reactor_accept(int epfd, int socketfd, struct connection_list *conns) {
+  while (!terminated) {
+    struct sockaddr_storage conn_addr;
+    socklen_t addr_size = sizeof(conn_addr);
+    int connfd = accept4(socketfd, (struct sockaddr *)&conn_addr, &addr_size,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (connfd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        syslog(LOG_ERR, "Error accepting connection: %s", strerror(errno));
+      return;
+    }
+
+    struct connection *conn = (struct connection *)malloc(sizeof(*conn));
+    if (!conn) {
+      syslog(LOG_ERR, "Out of memory accepting connection");
+      close(connfd);
+      continue;
+    }
+    connection_init(conn, connfd, &conn_addr);
+
+    struct epoll_event ev = {
+      .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+      .data.ptr = conn,
+    };
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, connfd, &ev) == -1) {
+      syslog(LOG_ERR, "Error registering connection: %s", strerror(errno));
+      close(connfd);
+      connection_free(conn);
+      free(conn);
       continue;
+    }
+    LIST_INSERT_HEAD(conns, conn, list);
+    syslog(LOG_INFO, "Accepted connection from %s",
+           inet_ntoa(((struct sockaddr_in *)&conn_addr)->sin_addr));
+  }
+}
 
-    status = stream_receive(data->connfd, &stream);
-    if (status == 0)
-      client_eof = 1;
-
-    while (stream_process(&stream)) {
-      pthread_mutex_lock(data->mutex);
-      switch (stream_line_type(&stream)) {
-        case STREAM_LINE_TYPE_DATA: {
-          int fdtarget = open(targetFile, O_CREAT | O_APPEND | O_WRONLY, 0644);
-          stream_write(&stream, fdtarget);
-          fsync(fdtarget);
-          close(fdtarget);
-
-          int fddata = open(targetFile, O_RDONLY);
-          send_data(data->connfd, fddata);
-          close(fddata);
-          break;
-        }
-        case STREAM_LINE_TYPE_SEEKTO: {
-          int fdtarget = open(targetFile, O_RDONLY, 0644);
-          stream_seekto(&stream, fdtarget);
-          send_data(data->connfd, fdtarget);
-          fsync(fdtarget);
-          close(fdtarget);
-          break;
-        }
+/*
+ * Receives what a ready non-blocking connection has and handles the complete
+ * lines. Returns as connection_process(); the connection is done once that is
+ * -1, or 1 with conn->eof set.
+ */
+int connection_ready(struct connection *conn) {
+  int status;
+  int full;
+  do {
+    // Drain the socket until it would block, or until the receive buffer is
+    // full and holds a line to handle. Only a full buffer without a complete
+    // line grows, so a stream of short lines never runs it up to
+    // STREAM_MAX_SIZE.
+    full = 0;
+    while (!conn->eof) {
+      if (stream_full(&conn->stream)) {
+        full = connection_next(conn);
+        if (full || conn->eof) break;
       }
-      pthread_mutex_unlock(data->mutex);
+      ssize_t len = stream_receive(conn->connfd, &conn->stream);
+      if (len > 0) continue;
+      if (len < 0 && errno == EINTR) continue;
+      if (len < 0 && errno == ENOBUFS) full = 1;
+      else if (len == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+        conn->eof = 1;
+      break;
     }
+
+    status = connection_process(conn);
+  } while (full && status == 1);
+  return status;
+}
+
+void reactor_handle(struct connection *conn, uint32_t events) {
+  // Nothing can be delivered on a failed or hung up socket, and reading it
+  // would only report the same error
+  if (events & (EPOLLERR | EPOLLHUP)) {
+    reactor_close(conn);
+    return;
   }
 
-  stream_free(&stream);
+  // Edge triggered, connection_ready() drains the socket
+  int status = connection_ready(conn);
+  if (status == -1 || (conn->eof && status == 1))
+    reactor_close(conn);
+}
 
-  syslog(LOG_INFO, "Closed connection from %s",
-         inet_ntoa(((struct sockaddr_in *)&(data->conn_addr))->sin_addr));
+/*
+ * One epoll reactor: accepts connections and serves every connection it
+ * accepted. Several reactors can share the listening socket.
+ */
+void * th_reactor(void * arg) {
+  reactor_data_t *data = (reactor_data_t *)arg;
+  struct connection_list conns;
+  LIST_INIT(&conns);
+
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd == -1) {
+    syslog(LOG_ERR, "Error creating epoll instance: %s", strerror(errno));
+    exit(-1);
+  }
 
+  struct epoll_event ev = {
+    .events = EPOLLIN | EPOLLEXCLUSIVE,
+    .data.ptr = &REACTOR_TAG_LISTEN,
+  };
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, data->socketfd, &ev) == -1) {
+    syslog(LOG_ERR, "Error registering listening socket: %s", strerror(errno));
+    exit(-1);
+  }
+  ev.events = EPOLLIN;
+  ev.data.ptr = &REACTOR_TAG_STOP;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, stop_fd, &ev) == -1) {
+    syslog(LOG_ERR, "Error registering stop event: %s", strerror(errno));
+    exit(-1);
+  }
+  ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+  ev.data.ptr = &REACTOR_TAG_TIMER;
+  if (timer_fd >= 0 && epoll_ctl(epfd, EPOLL_CTL_ADD, timer_fd, &ev) == -1) {
+    syslog(LOG_ERR, "Error registering timestamp timer: %s", strerror(errno));
+    exit(-1);
+  }
+
+  struct epoll_event events[64];
+  while (!terminated) {
+    int n = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]), -1);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      syslog(LOG_ERR, "Error waiting for events: %s", strerror(errno));
+      exit(-1);
+    }
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.ptr == &REACTOR_TAG_LISTEN)
+        reactor_accept(epfd, data->socketfd, &conns);
+      else if (events[i].data.ptr == &REACTOR_TAG_TIMER)
+        timestamp_tick(&timestamp);
+      else if (events[i].data.ptr != &REACTOR_TAG_STOP)
+        reactor_handle(events[i].data.ptr, events[i].events);
+    }
+  }
+
+  while (!LIST_EMPTY(&conns))
+    reactor_close(LIST_FIRST(&conns));
+  close(epfd);
   return NULL;
 }
 
-typedef struct {
-  pthread_mutex_t *mutex;
-} timer_th_data_t;
+/*
+ * Raises the soft open file limit to the hard limit so a reactor can hold
+ * many thousands of idle connections.
+ */
+void raise_fd_limit(void) {
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+}
+
+/*
+ * Creates the event that wakes the event loops once a signal asks to stop.
+ */
+int stop_event_open(void) {
+  stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (stop_fd == -1) {
+    syslog(LOG_ERR, "Error creating stop event: %s", strerror(errno));
+    return -1;
+  }
+  if (terminated) {
+    uint64_t one = 1;
+    write(stop_fd, &one, sizeof(one));
+  }
+  return 0;
+}
+
+void stop_event_close(void) {
+  close(stop_fd);
+  stop_fd = -1;
+}
+
+int run_reactors(int socketfd, int nthreads) {
+  if (stop_event_open() == -1) return -1;
+  raise_fd_limit();
+  fcntl(socketfd, F_SETFL, fcntl(socketfd, F_GETFL) | O_NONBLOCK);
+
+  reactor_data_t data = {.socketfd = socketfd};
+  pthread_t *reactors = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+  for (int i = 0; i < nthreads; i++)
+    pthread_create(&reactors[i], NULL, &th_reactor, (void *)&data);
+  for (int i = 0; i < nthreads; i++)
+    pthread_join(reactors[i], NULL);
+  free(reactors);
+
+  stop_event_close();
+  return 0;
+}
+
+/*
+ * Worker pool serving connections without -e, -t or -u. main() accepts the
+ * connections and registers them one shot with the pool's epoll instance,
+ * which every idle worker waits on: a worker handles what one ready
+ * connection has, then rearms it. A connection is only ever handled by one
+ * worker at a time, and the workers only bound how many connections are
+ * handled at once, not how many are served. main() only accepts a connection
+ * once it has taken one of the max_connections slots counted by slot_fd, so
+ * when every slot is taken new connections wait in the listen backlog instead
+ * of using memory. A connection gives its slot back as soon as it is closed.
+ */
+struct pool {
+  pthread_mutex_t mutex;  // covers conns
+  struct connection_list conns;
+  int epfd;
+  unsigned size;
+  int slot_fd;  // semaphore eventfd counting the free slots
+  pthread_t *workers;
+  int nworkers;
+};
 
-void * th_timer(void * arg) {
-  timer_th_data_t *data = (timer_th_data_t *)arg;
+struct pool pool = {
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+  .epfd = -1,
+  .slot_fd = -1,
+};
 
-  struct timespec t;
-  int ret = clock_gettime(CLOCK_MONOTONIC, &t);
-  if (ret) { perror("clock_gettime"); exit(-1); }
+static char POOL_TAG_STOP;
 
-  t.tv_sec += 10;
+void pool_release_slot(void) {
+  uint64_t one = 1;
+  write(pool.slot_fd, &one, sizeof(one));
+}
 
+/*
+ * Waits for a free connection slot. Returns 1 once one is taken, 0 when the
+ * server is stopping and -1 on error.
+ */
+int pool_acquire_slot(void) {
+  struct pollfd fds[3] = {
+    {.fd = pool.slot_fd, .events = POLLIN},
+    {.fd = stop_fd, .events = POLLIN},
+    {.fd = timer_fd, .events = POLLIN},
+  };
+  int saturated = 0;
   while (!terminated) {
-    ret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL);
-    if (ret == EINTR) {
-      if (terminated) break; else continue;
+    uint64_t value;
+    if (read(pool.slot_fd, &value, sizeof(value)) == sizeof(value)) {
+      if (saturated)
+        syslog(LOG_INFO, "Accepting connections again");
+      return 1;
+    }
+    if (errno != EAGAIN && errno != EINTR) {
+      syslog(LOG_ERR, "Error taking a connection slot: %s", strerror(errno));
+      return -1;
+    }
+    if (!saturated) {
+      syslog(LOG_WARNING, "All %u connection slots in use, not accepting",
+             pool.size);
+      saturated = 1;
+    }
+    if (poll(fds, 3, -1) == -1 && errno != EINTR) {
+      syslog(LOG_ERR, "Error waiting for a connection slot: %s", strerror(errno));
+      return -1;
     }
-    t.tv_sec += 10;
+    if (fds[2].revents & POLLIN) timestamp_tick(&timestamp);
+  }
+  return 0;
+}
+
+void pool_close(struct connection *conn) {
+  pthread_mutex_lock(&pool.mutex);
+  reactor_close(conn);
+  pthread_mutex_unlock(&pool.mutex);
+  pool_release_slot();
+}
+
+/*
+ * Hands an accepted connection to the workers. The caller holds a slot for
+ * it, which the connection gives back once closed.
+ */
+void pool_submit(thread_data_t *data) {
+  struct connection *conn = (struct connection *)malloc(sizeof(*conn));
+  if (!conn) {
+    syslog(LOG_ERR, "Out of memory accepting connection");
+    close(data->connfd);
+    pool_release_slot();
+    return;
+  }
+  connection_init(conn, data->connfd, &data->conn_addr);
+  fcntl(conn->connfd, F_SETFL, fcntl(conn->connfd, F_GETFL) | O_NONBLOCK);
+
+  pthread_mutex_lock(&pool.mutex);
+  LIST_INSERT_HEAD(&pool.conns, conn, list);
+  pthread_mutex_unlock(&pool.mutex);
+
+  struct epoll_event ev = {
+    .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT,
+    .data.ptr = conn,
+  };
+  if (epoll_ctl(pool.epfd, EPOLL_CTL_ADD, conn->connfd, &ev) == -1) {
+    syslog(LOG_ERR, "Error registering connection: %s", strerror(errno));
+    pool_close(conn);
+  }
+}
+
+/*
+ * Handles a ready connection and rearms it: for the pending reply when the
+ * socket would block, else for more data.
+ */
+void pool_handle(struct connection *conn, uint32_t events) {
+  int status = -1;
+  if (!(events & (EPOLLERR | EPOLLHUP))) status = connection_ready(conn);
+  if (status == -1 || (conn->eof && status == 1)) {
+    pool_close(conn);
+    return;
+  }
 
-    pthread_mutex_lock(data->mutex);
-    int fdtarget = open(targetFile, O_CREAT | O_APPEND | O_WRONLY, 0644);
-    if (fdtarget < 0) {
-      syslog(LOG_ERR, "timer couldn't open file");
-      perror("open");
+  // Level triggered, so only wait for input while it can be taken
+  struct epoll_event ev = {
+    .events = (status == 0 ? EPOLLOUT : EPOLLIN | EPOLLRDHUP) | EPOLLONESHOT,
+    .data.ptr = conn,
+  };
+  if (epoll_ctl(pool.epfd, EPOLL_CTL_MOD, conn->connfd, &ev) == -1) {
+    syslog(LOG_ERR, "Error rearming connection: %s", strerror(errno));
+    pool_close(conn);
+  }
+}
+
+void * th_worker(void * arg) {
+  (void)arg;
+  while (!terminated) {
+    struct epoll_event ev;
+    int n = epoll_wait(pool.epfd, &ev, 1, -1);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      syslog(LOG_ERR, "Error waiting for connections: %s", strerror(errno));
       exit(-1);
     }
+    if (n == 0) continue;
+    if (ev.data.ptr == &POOL_TAG_STOP) break;
+    pool_handle(ev.data.ptr, ev.events);
+  }
+  return NULL;
+}
+
+int pool_start(int nworkers, unsigned max_connections) {
+  if ((unsigned)nworkers > max_connections) nworkers = max_connections;
+  raise_fd_limit();
+  LIST_INIT(&pool.conns);
+  pool.size = max_connections;
+  pool.slot_fd = eventfd(max_connections, EFD_CLOEXEC | EFD_NONBLOCK | EFD_SEMAPHORE);
+  pool.epfd = epoll_create1(EPOLL_CLOEXEC);
+  pool.workers = (pthread_t *)calloc(nworkers, sizeof(pthread_t));
+  // Level triggered, wakes every worker once stopping
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &POOL_TAG_STOP};
+  if (pool.slot_fd == -1 || pool.epfd == -1 || !pool.workers ||
+      epoll_ctl(pool.epfd, EPOLL_CTL_ADD, stop_fd, &ev) == -1) {
+    syslog(LOG_ERR, "Error setting up worker pool: %s", strerror(errno));
+    return -1;
+  }
+
+  for (pool.nworkers = 0; pool.nworkers < nworkers; pool.nworkers++) {
+    if (pthread_create(&pool.workers[pool.nworkers], NULL, &th_worker, NULL) != 0) {
+      syslog(LOG_ERR, "Error starting worker: %s", strerror(errno));
+      break;
+    }
+  }
+  return pool.nworkers > 0 ? 0 : -1;
+}
+
+/*
+ * Joins the workers, which return once the stop event is set, then closes the
+ * connections left.
+ */
+void pool_stop(void) {
+  for (int i = 0; i < pool.nworkers; i++)
+    pthread_join(pool.workers[i], NULL);
+  while (!LIST_EMPTY(&pool.conns))
+    pool_close(LIST_FIRST(&pool.conns));
+  free(pool.workers);
+  close(pool.epfd);
+  close(pool.slot_fd);
+}
+
+#ifdef USE_IO_URING
+/*
+ * io_uring engine, used with -u. Like a reactor, each engine thread accepts
+ * from the shared listening socket and serves the connections it accepted,
+ * but accepts, receives and replies are queued on the thread's ring and all
+ * of them are submitted with a single io_uring_enter() per loop iteration.
+ *
+ * Lines are still appended with target_append(), which publishes them in
+ * reservation order, so only the durability and the reply are asynchronous.
+ * Each reply chunk is one linked chain:
+ *   [fdatasync ->] read of the target into a registered buffer -> send
+ * The listening socket and the target descriptors are registered files.
+ * The ring is set up with the raw system calls, liburing is not needed.
+ */
+#define URING_ENTRIES 1024
+#define URING_CQ_ENTRIES 8192
+#define URING_BUFS 64
+#define URING_BUF_SIZE (64 * 1024)
+
+struct uring {
+  int fd;
+  unsigned entries;
+  unsigned tail;  // sq tail including SQEs not yet published to the kernel
+  unsigned *sq_head, *sq_tail, *sq_mask;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_map, *cq_map;
+  size_t sq_map_size, cq_map_size;
+};
+
+int uring_setup(struct uring *ring) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = URING_CQ_ENTRIES;
+  ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+  if (ring->fd < 0) return -1;
+
+  ring->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_map_size > ring->sq_map_size)
+      ring->sq_map_size = ring->cq_map_size;
+    ring->cq_map_size = 0;
+  }
+  ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  ring->cq_map = ring->sq_map;
+  if (ring->cq_map_size)
+    ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  ring->sqes = (struct io_uring_sqe *)mmap(NULL,
+      p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED ||
+      ring->sqes == MAP_FAILED) {
+    close(ring->fd);
+    return -1;
+  }
+
+  char *sq = (char *)ring->sq_map;
+  char *cq = (char *)ring->cq_map;
+  ring->entries = p.sq_entries;
+  ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  ring->tail = *ring->sq_tail;
+  // SQE i always sits in slot i of the submission queue
+  unsigned *array = (unsigned *)(sq + p.sq_off.array);
+  for (unsigned i = 0; i < p.sq_entries; i++) array[i] = i;
+  return 0;
+}
+
+void uring_close(struct uring *ring) {
+  munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+  if (ring->cq_map_size) munmap(ring->cq_map, ring->cq_map_size);
+  munmap(ring->sq_map, ring->sq_map_size);
+  close(ring->fd);
+}
+
+/*
+ * Submits the queued SQEs and waits for at least wait completions. Returns -1
+ * with errno set on error.
+ */
+int uring_submit(struct uring *ring, unsigned wait) {
+  unsigned to_submit = ring->tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  __atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+  if (to_submit == 0 && wait == 0) return 0;
+  return syscall(__NR_io_uring_enter, ring->fd, to_submit, wait,
+                 wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0) < 0 ? -1 : 0;
+}
+
+/*
+ * Makes room for n more SQEs, submitting the queued ones if needed, so that a
+ * linked chain is never split. Returns -1 if the queue stays full.
+ */
+int uring_reserve(struct uring *ring, unsigned n) {
+  if (ring->entries - (ring->tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)) >= n)
+    return 0;
+  if (uring_submit(ring, 0) == -1 && errno != EINTR)
+    syslog(LOG_ERR, "Error submitting to io_uring: %s", strerror(errno));
+  if (ring->entries - (ring->tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)) >= n)
+    return 0;
+  errno = EBUSY;
+  return -1;
+}
+
+/*
+ * Queues an SQE for op on fd. Room must have been made with uring_reserve().
+ */
+struct io_uring_sqe *uring_prep(struct uring *ring, int op, int fd,
+                                uint64_t user_data) {
+  struct io_uring_sqe *sqe = &ring->sqes[ring->tail & *ring->sq_mask];
+  ring->tail++;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = op;
+  sqe->fd = fd;
+  sqe->user_data = user_data;
+  return sqe;
+}
+
+/*
+ * Indexes of the registered files
+ */
+enum {
+  URING_FILE_LISTEN,
+  URING_FILE_TARGET_WRITE,
+  URING_FILE_TARGET_READ,
+  URING_FILES,
+};
+
+/*
+ * Operations, kept in the low bits of the user_data of an SQE next to the
+ * connection or engine it belongs to. Both are allocated with malloc(), which
+ * aligns them to 16 bytes.
+ */
+enum {
+  URING_OP_ACCEPT = 1,
+  URING_OP_STOP,
+  URING_OP_CANCEL,
+  URING_OP_RECV,
+  URING_OP_FSYNC,
+  URING_OP_READ,
+  URING_OP_SEND,
+  URING_OP_TIMER,
+};
+#define URING_OP_MASK 15
+
+struct uring_conn {
+  struct connection conn;  // first, so reactor_close() frees the uring_conn
+  unsigned inflight;       // SQEs queued and not completed
+  int buf;                 // registered buffer of the reply, -1 if none
+  int sync;                // the next reply chunk starts with fdatasync
+  size_t chunk;            // bytes read and sent by the chunk in flight
+  size_t head;             // of which the frame header copied in front
+  size_t sent;
+  int read_res;
+  int send_res;
+  int closing;
+  int waiting;             // on the engine waiting list for a buffer
+  TAILQ_ENTRY(uring_conn) wait;
+};
+
+struct uring_engine {
+  struct uring ring;
+  int socketfd;
+  int fixed_files;
+  int fixed_bufs;
+  char *bufs;
+  int free_bufs[URING_BUFS];
+  int nfree;
+  TAILQ_HEAD(, uring_conn) waiting;
+  struct connection_list conns;
+  struct sockaddr_storage accept_addr;
+  socklen_t accept_len;
+  int accepting;
+  int timing;  // polling the timestamp timer
+  int stopping;
+};
+
+uint64_t uring_data(void *ptr, int op) {
+  return (uint64_t)(uintptr_t)ptr | op;
+}
+
+/*
+ * Points sqe at the registered file index when files are registered, and at
+ * fd otherwise.
+ */
+void uring_file(struct uring_engine *e, struct io_uring_sqe *sqe, int index,
+                int fd) {
+  if (e->fixed_files) {
+    sqe->fd = index;
+    sqe->flags |= IOSQE_FIXED_FILE;
+  } else {
+    sqe->fd = fd;
+  }
+}
+
+void uring_accept(struct uring_engine *e) {
+  if (uring_reserve(&e->ring, 1) == -1) {
+    syslog(LOG_ERR, "Error queuing accept: %s", strerror(errno));
+    return;
+  }
+  e->accept_len = sizeof(e->accept_addr);
+  struct io_uring_sqe *sqe = uring_prep(&e->ring, IORING_OP_ACCEPT, -1,
+                                        uring_data(e, URING_OP_ACCEPT));
+  uring_file(e, sqe, URING_FILE_LISTEN, e->socketfd);
+  sqe->addr = (uintptr_t)&e->accept_addr;
+  sqe->addr2 = (uintptr_t)&e->accept_len;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  e->accepting = 1;
+}
+
+void uring_timer(struct uring_engine *e) {
+  if (timer_fd < 0 || uring_reserve(&e->ring, 1) == -1) return;
+  struct io_uring_sqe *sqe = uring_prep(&e->ring, IORING_OP_POLL_ADD, timer_fd,
+                                        uring_data(e, URING_OP_TIMER));
+  sqe->poll32_events = POLLIN;
+  e->timing = 1;
+}
+
+int uring_recv(struct uring_engine *e, struct uring_conn *uc) {
+  struct iovec iov[2];
+  if (stream_space(&uc->conn.stream, iov) == -1 ||
+      uring_reserve(&e->ring, 1) == -1)
+    return -1;
+  struct io_uring_sqe *sqe = uring_prep(&e->ring, IORING_OP_RECV,
+                                        uc->conn.connfd,
+                                        uring_data(uc, URING_OP_RECV));
+  sqe->addr = (uintptr_t)iov[0].iov_base;
+  sqe->len = iov[0].iov_len;
+  uc->inflight++;
+  return 0;
+}
+
+int uring_send(struct uring_engine *e, struct uring_conn *uc) {
+  if (uring_reserve(&e->ring, 1) == -1) return -1;
+  struct io_uring_sqe *sqe = uring_prep(&e->ring, IORING_OP_SEND,
+                                        uc->conn.connfd,
+                                        uring_data(uc, URING_OP_SEND));
+  sqe->addr = (uintptr_t)(e->bufs + (size_t)uc->buf * URING_BUF_SIZE + uc->sent);
+  sqe->len = uc->chunk - uc->sent;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  uc->send_res = 0;
+  uc->inflight++;
+  return 0;
+}
+
+void uring_continue(struct uring_engine *e, struct uring_conn *uc);
+
+/*
+ * Returns the registered buffer of a finished reply and hands it to the
+ * first connection waiting for one.
+ */
+void uring_release_buf(struct uring_engine *e, struct uring_conn *uc) {
+  if (uc->buf < 0) return;
+  e->free_bufs[e->nfree++] = uc->buf;
+  uc->buf = -1;
+
+  struct uring_conn *next = TAILQ_FIRST(&e->waiting);
+  if (next) {
+    TAILQ_REMOVE(&e->waiting, next, wait);
+    next->waiting = 0;
+    uring_continue(e, next);
+  }
+}
+
+/*
+ * Queues the next chunk of the reply in progress. Returns 1 when a chunk was
+ * queued or the connection waits for a buffer, 0 when the reply is complete
+ * and -1 on error.
+ */
+int uring_reply_step(struct uring_engine *e, struct uring_conn *uc) {
+  struct reply *reply = &uc->conn.reply;
+  size_t head = reply->head_len - reply->head_sent;
+  size_t len = reply->end - reply->offset;
+  if (len == 0 && head == 0 && !uc->sync) {
+    reply->fd = -1;
+    reply->head_len = reply->head_sent = 0;
+    uring_release_buf(e, uc);
+    return 0;
+  }
+  if (len > URING_BUF_SIZE - head) len = URING_BUF_SIZE - head;
+
+  if (uc->buf < 0) {
+    if (e->nfree == 0) {
+      TAILQ_INSERT_TAIL(&e->waiting, uc, wait);
+      uc->waiting = 1;
+      return 1;
+    }
+    uc->buf = e->free_bufs[--e->nfree];
+  }
+  if (uring_reserve(&e->ring, 3) == -1) return -1;
+
+  struct io_uring_sqe *sqe;
+  if (uc->sync) {
+    // A failed sync is logged and the reply still goes out, as with fdatasync()
+    sqe = uring_prep(&e->ring, IORING_OP_FSYNC, -1, uring_data(uc, URING_OP_FSYNC));
+    uring_file(e, sqe, URING_FILE_TARGET_WRITE, target.wfd);
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    if (len || head) sqe->flags |= IOSQE_IO_HARDLINK;
+    uc->sync = 0;
+    uc->inflight++;
+  }
+  uc->head = head;
+  uc->chunk = head + len;
+  uc->sent = 0;
+  uc->read_res = 0;
+  uc->send_res = 0;
+  if (uc->chunk == 0) return 1;
+
+  char *buf = e->bufs + (size_t)uc->buf * URING_BUF_SIZE;
+  memcpy(buf, reply->head + reply->head_sent, head);
+  reply->head_sent = reply->head_len;
+  if (len) {
+    sqe = uring_prep(&e->ring, e->fixed_bufs ? IORING_OP_READ_FIXED : IORING_OP_READ,
+                     -1, uring_data(uc, URING_OP_READ));
+    uring_file(e, sqe, URING_FILE_TARGET_READ, target.rfd);
+    sqe->addr = (uintptr_t)(buf + head);
+    sqe->len = len;
+    sqe->off = reply->offset;
+    sqe->buf_index = uc->buf;
+    // A short read fails the link, see uring_chunk_done()
+    sqe->flags |= IOSQE_IO_LINK;
+    uc->inflight++;
+  }
+  return uring_send(e, uc) == -1 ? -1 : 1;
+}
+
+/*
+ * Starts replying to the next line or receiving more once every line is
+ * handled, and closes the connection once it is done.
+ */
+void uring_continue(struct uring_engine *e, struct uring_conn *uc) {
+  struct connection *conn = &uc->conn;
+  while (!uc->closing) {
+    if (conn->reply.fd >= 0) {
+      int status = uring_reply_step(e, uc);
+      if (status == 1) return;
+      if (status == -1) {
+        syslog(LOG_ERR, "Error queuing reply: %s", strerror(errno));
+        uc->closing = 1;
+      }
+      continue;
+    }
+
+    if (connection_next(conn)) {
+      off_t offset, end;
+      int type = connection_line(conn, &offset, &end);
+      if (type == STREAM_LINE_TYPE_MODE) continue;
+      if (type == STREAM_LINE_TYPE_FAILED) {
+        uc->closing = 1;
+        continue;
+      }
+      if (type == STREAM_LINE_TYPE_DATA) {
+        // The sync goes at the head of the reply chain
+        if (target.durability == DURABILITY_LINE && !target.batched)
+          uc->sync = 1;
+        else target_commit(&target);
+      }
+      conn->reply.fd = target.rfd;
+      conn->reply.offset = offset;
+      conn->reply.end = end;
+      continue;
+    }
+
+    if (conn->eof || e->stopping || uring_recv(e, uc) == -1) {
+      uc->closing = 1;
+      continue;
+    }
+    return;
+  }
+
+  if (uc->inflight == 0) {
+    uring_release_buf(e, uc);
+    reactor_close(conn);
+  }
+}
+
+/*
+ * Called once every SQE of a reply chunk has completed.
+ */
+void uring_chunk_done(struct uring_engine *e, struct uring_conn *uc) {
+  struct reply *reply = &uc->conn.reply;
+
+  if (uc->read_res < 0 && uc->read_res != -ECANCELED) {
+    syslog(LOG_ERR, "Error reading reply at offset %lld: %s",
+           (long long)reply->offset, strerror(-uc->read_res));
+    uc->closing = 1;
+  } else if (uc->send_res == -ECANCELED) {
+    // The read came up short: the target shrank, send what there is
+    syslog(LOG_WARNING, "Reply truncated at offset %lld of %lld",
+           (long long)(reply->offset + uc->read_res), (long long)reply->end);
+    reply->end = reply->offset + uc->read_res;
+    uc->chunk = uc->head + uc->read_res;
+    // Unless its frame header promised more
+    if (!reply->head_len && uc->chunk > 0 && uring_send(e, uc) == 0) return;
+    if (reply->head_len) uc->closing = 1;
+  } else if (uc->send_res < 0) {
+    syslog(LOG_ERR, "Error sending reply at offset %lld of %lld: %s",
+           (long long)reply->offset, (long long)reply->end,
+           strerror(-uc->send_res));
+    uc->closing = 1;
+  } else {
+    uc->sent += uc->send_res;
+    if (uc->sent < uc->chunk) {
+      if (uring_send(e, uc) == 0) return;
+      uc->closing = 1;
+    }
+  }
+  if (!uc->closing) reply->offset += uc->chunk - uc->head;
+  uring_continue(e, uc);
+}
+
+void uring_complete_conn(struct uring_engine *e, struct uring_conn *uc, int op,
+                         int res) {
+  uc->inflight--;
+  switch (op) {
+    case URING_OP_RECV:
+      if (res > 0) {
+        uc->conn.stream.len += res;
+      } else if (res != -EINTR && res != -EAGAIN) {
+        if (res < 0 && res != -ECONNRESET)
+          syslog(LOG_ERR, "Error receiving: %s", strerror(-res));
+        uc->conn.eof = 1;
+      }
+      uring_continue(e, uc);
+      return;
+    case URING_OP_FSYNC:
+      if (res < 0)
+        syslog(LOG_ERR, "Error syncing target: %s", strerror(-res));
+      break;
+    case URING_OP_READ:
+      uc->read_res = res;
+      break;
+    case URING_OP_SEND:
+      uc->send_res = res;
+      break;
+  }
+  if (uc->inflight == 0) uring_chunk_done(e, uc);
+}
+
+void uring_complete_accept(struct uring_engine *e, int res) {
+  e->accepting = 0;
+  if (res >= 0) {
+    struct uring_conn *uc = (struct uring_conn *)malloc(sizeof(*uc));
+    if (!uc) {
+      syslog(LOG_ERR, "Out of memory accepting connection");
+      close(res);
+    } else {
+      connection_init(&uc->conn, res, &e->accept_addr);
+      uc->inflight = 0;
+      uc->buf = -1;
+      uc->sync = 0;
+      uc->closing = 0;
+      uc->waiting = 0;
+      LIST_INSERT_HEAD(&e->conns, &uc->conn, list);
+      syslog(LOG_INFO, "Accepted connection from %s",
+             inet_ntoa(((struct sockaddr_in *)&e->accept_addr)->sin_addr));
+      uring_continue(e, uc);
+    }
+  } else if (res != -EINTR && res != -ECONNABORTED && res != -ECANCELED) {
+    syslog(LOG_ERR, "Error accepting connection: %s", strerror(-res));
+  }
+  if (!e->stopping) uring_accept(e);
+}
+
+/*
+ * Stops accepting and shuts every connection down, so the operations still
+ * in flight complete and the loop can finish once they have.
+ */
+void uring_stop(struct uring_engine *e) {
+  e->stopping = 1;
+  if (e->accepting && uring_reserve(&e->ring, 1) == 0) {
+    struct io_uring_sqe *sqe = uring_prep(&e->ring, IORING_OP_ASYNC_CANCEL, -1,
+                                          uring_data(e, URING_OP_CANCEL));
+    sqe->addr = uring_data(e, URING_OP_ACCEPT);
+  }
+  if (e->timing && uring_reserve(&e->ring, 1) == 0) {
+    struct io_uring_sqe *sqe = uring_prep(&e->ring, IORING_OP_ASYNC_CANCEL, -1,
+                                          uring_data(e, URING_OP_CANCEL));
+    sqe->addr = uring_data(e, URING_OP_TIMER);
+  }
+
+  struct connection *conn = LIST_FIRST(&e->conns);
+  while (conn) {
+    struct connection *next = LIST_NEXT(conn, list);
+    struct uring_conn *uc = (struct uring_conn *)conn;
+    shutdown(conn->connfd, SHUT_RDWR);
+    if (uc->waiting) {
+      TAILQ_REMOVE(&e->waiting, uc, wait);
+      uc->waiting = 0;
+      uc->closing = 1;
+      uring_continue(e, uc);
+    }
+    conn = next;
+  }
+}
+
+int uring_engine_init(struct uring_engine *e, int socketfd) {
+  memset(e, 0, sizeof(*e));
+  e->socketfd = socketfd;
+  TAILQ_INIT(&e->waiting);
+  LIST_INIT(&e->conns);
+  if (uring_setup(&e->ring) == -1) return -1;
+
+  int files[URING_FILES] = { socketfd, target.wfd, target.rfd };
+  e->fixed_files = syscall(__NR_io_uring_register, e->ring.fd,
+                           IORING_REGISTER_FILES, files, URING_FILES) == 0;
+
+  if (posix_memalign((void **)&e->bufs, 4096, (size_t)URING_BUFS * URING_BUF_SIZE)) {
+    uring_close(&e->ring);
+    return -1;
+  }
+  struct iovec iov[URING_BUFS];
+  for (int i = 0; i < URING_BUFS; i++) {
+    iov[i].iov_base = e->bufs + (size_t)i * URING_BUF_SIZE;
+    iov[i].iov_len = URING_BUF_SIZE;
+    e->free_bufs[i] = URING_BUFS - 1 - i;
+  }
+  e->nfree = URING_BUFS;
+  // Registration pins the buffers and may exceed RLIMIT_MEMLOCK on old kernels
+  e->fixed_bufs = syscall(__NR_io_uring_register, e->ring.fd,
+                          IORING_REGISTER_BUFFERS, iov, URING_BUFS) == 0;
+  if (!e->fixed_files || !e->fixed_bufs)
+    syslog(LOG_DEBUG, "io_uring registered files %d, buffers %d",
+           e->fixed_files, e->fixed_bufs);
+  return 0;
+}
+
+void uring_engine_free(struct uring_engine *e) {
+  uring_close(&e->ring);
+  free(e->bufs);
+}
 
-    #ifndef USE_AESD_CHAR_DEVICE
-    time_t now = time(NULL);
-    struct tm *nowtm = gmtime(&now);
-    char outstr[200];
-    int size = strftime(outstr, sizeof(outstr)-1, "%a, %d %b %Y %T %z", nowtm);
-    outstr[size-1] = '\n';
+void * th_uring(void * arg) {
+  reactor_data_t *data = (reactor_data_t *)arg;
+  struct uring_engine *e = (struct uring_engine *)malloc(sizeof(*e));
+  if (!e || uring_engine_init(e, data->socketfd) == -1) {
+    syslog(LOG_ERR, "Error setting up io_uring: %s", strerror(errno));
+    exit(-1);
+  }
 
-    const char prefix[] = "timestamp:";
-    write(fdtarget, prefix, sizeof(prefix)-1);
-    write(fdtarget, outstr, size);
-    #endif
+  uring_accept(e);
+  if (uring_reserve(&e->ring, 1) == 0) {
+    struct io_uring_sqe *sqe = uring_prep(&e->ring, IORING_OP_POLL_ADD, stop_fd,
+                                          uring_data(e, URING_OP_STOP));
+    sqe->poll32_events = POLLIN;
+  }
+  uring_timer(e);
 
-    close(fdtarget);
+  while (!e->stopping || e->accepting || e->timing ||
+         !LIST_EMPTY(&e->conns)) {
+    if (uring_submit(&e->ring, 1) == -1) {
+      if (errno == EINTR) continue;
+      syslog(LOG_ERR, "Error waiting for io_uring: %s", strerror(errno));
+      exit(-1);
+    }
 
-    pthread_mutex_unlock(data->mutex);
+    unsigned head = *e->ring.cq_head;
+    unsigned tail = __atomic_load_n(e->ring.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      struct io_uring_cqe *cqe = &e->ring.cqes[head & *e->ring.cq_mask];
+      int op = cqe->user_data & URING_OP_MASK;
+      void *ptr = (void *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_OP_MASK);
+      int res = cqe->res;
+      // Release the slot first, handlers may wait for completions
+      __atomic_store_n(e->ring.cq_head, head + 1, __ATOMIC_RELEASE);
+
+      if (op == URING_OP_ACCEPT)
+        uring_complete_accept(e, res);
+      else if (op == URING_OP_STOP)
+        uring_stop(e);
+      else if (op == URING_OP_TIMER) {
+        e->timing = 0;
+        if (res >= 0) timestamp_tick(&timestamp);
+        if (!e->stopping) uring_timer(e);
+      }
+      else if (op != URING_OP_CANCEL)
+        uring_complete_conn(e, (struct uring_conn *)ptr, op, res);
+    }
   }
+
+  uring_engine_free(e);
+  free(e);
   return NULL;
 }
 
+/*
+ * Serves connections from nthreads io_uring engines. Returns -1 without
+ * serving anything when io_uring is not available.
+ */
+int run_uring(int socketfd, int nthreads) {
+  struct uring probe;
+  if (uring_setup(&probe) == -1) {
+    syslog(LOG_WARNING, "io_uring not available: %s", strerror(errno));
+    return -1;
+  }
+  uring_close(&probe);
+
+  if (stop_event_open() == -1) return -1;
+  raise_fd_limit();
+
+  reactor_data_t data = {.socketfd = socketfd};
+  pthread_t *engines = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+  for (int i = 0; i < nthreads; i++)
+    pthread_create(&engines[i], NULL, &th_uring, (void *)&data);
+  for (int i = 0; i < nthreads; i++)
+    pthread_join(engines[i], NULL);
+  free(engines);
+
+  stop_event_close();
+  return 0;
+}
+#endif
+
+/*
+ * Options:
+ *   -d    run as a daemon
+ *   -w N  serve connections from a pool of N worker threads (default 64),
+ *         each handling whichever connection has data or room for its reply
+ *   -m N  accept at most N connections at a time (default 1024); further
+ *         connections wait in the backlog
+ *   -e    serve connections from an edge-triggered epoll reactor instead of
+ *         the worker pool
+ *   -t N  like -e, with N reactor threads
+ *   -u    serve connections from io_uring instead of epoll, with as many
+ *         threads as -t; falls back to epoll when io_uring is not available
+ *   -i    reply with only the data appended since the previous reply; a
+ *         client selects per connection with AESDSOCKET_MODE:tail or
+ *         AESDSOCKET_MODE:full. Only with the data file, replies from
+ *         /dev/aesdchar are always full
+ *   -s M  durability of appended lines: "line" (fdatasync every line, the
+ *         default), "group" (batched fdatasync) or "none"
+ *   -n N  group commit after at most N lines (default 64)
+ *   -g MS group commit at most MS milliseconds after a line (default 10)
+ *   -T S  append a timestamp line every S seconds (default 10)
+ *   -f F  strftime() format of the timestamps (default "%a, %d %b %Y %T %z")
+ *   -b    append lines from a single writer thread, batching the lines of
+ *         concurrent connections into one writev() and, unless -s none, one
+ *         fdatasync; "group" then behaves like "line"
+ */
 int main(int argc, char* argv[]) {
   int opt;
   int daemon = 0;
-  while ((opt = getopt(argc, argv, "d")) != -1) {
+  int reactor_threads = 0;
+  int use_uring = 0;
+  int workers = 64;
+  int max_connections = 1024;
+  while ((opt = getopt(argc, argv, "dw:m:eit:us:n:g:bT:f:")) != -1) {
     switch (opt) {
       case 'd':
         daemon = 1;
         break;
+      case 'w':
+        workers = atoi(optarg) > 0 ? atoi(optarg) : 1;
+        break;
+      case 'm':
+        max_connections = atoi(optarg) > 0 ? atoi(optarg) : 1;
+        break;
+      case 'e':
+        if (reactor_threads == 0) reactor_threads = 1;
+        break;
+      case 'i':
+        tail_mode = 1;
+        break;
+      case 't':
+        reactor_threads = atoi(optarg);
+        if (reactor_threads < 1) reactor_threads = 1;
+        break;
+      case 'u':
+        use_uring = 1;
+        break;
+      case 's':
+        if (parse_durability(optarg, &target.durability) == -1) {
+          fprintf(stderr, "Unknown durability %s\n", optarg);
+          exit(-1);
+        }
+        break;
+      case 'n':
+        target.group_lines = atoi(optarg) > 0 ? atoi(optarg) : 1;
+        break;
+      case 'g':
+        target.group_ms = atoi(optarg) > 0 ? atoi(optarg) : 1;
+        break;
+      case 'b':
+        target.batched = 1;
+        break;
+      case 'T':
+        timestamp.interval = atoi(optarg) > 0 ? atoi(optarg) : 1;
+        break;
+      case 'f':
+        timestamp.format = optarg;
+        break;
     }
   }
 
@@ -373,62 +2573,71 @@ int main(int argc, char* argv[]) {
 
   signal(SIGTERM, handle_signal);
   signal(SIGINT, handle_signal);
+  // sendfile() and splice() have no MSG_NOSIGNAL; report EPIPE instead.
+  signal(SIGPIPE, SIG_IGN);
 
   struct addrinfo *servinfo;
   int socketfd = listen_socket(daemon, &servinfo);
   if (socketfd == -1) exit(-1);
 
-  struct tl_list tl_list;
-  SLIST_INIT(&tl_list);
-
-  pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
+  if (target_open(&target) == -1) exit(-1);
+  if (tail_mode && !target.is_file) {
+    syslog(LOG_WARNING, "Tail replies need a regular file, sending full replies");
+    tail_mode = 0;
+  }
+  if (target.batched && writer_start(&writer, &target) == -1) exit(-1);
+
+  if (timestamp_open(&timestamp) == -1) exit(-1);
+
+  int served = 0;
+  if (use_uring) {
+#ifdef USE_IO_URING
+    served = run_uring(socketfd, reactor_threads > 0 ? reactor_threads : 1) == 0;
+#endif
+    if (!served) {
+      syslog(LOG_WARNING, "Serving connections with epoll instead of io_uring");
+      if (reactor_threads == 0) reactor_threads = 1;
+    }
+  }
+  if (!served && reactor_threads > 0 &&
+      run_reactors(socketfd, reactor_threads) == -1)
+    exit(-1);
 
-  timer_th_data_t timer_data;
-  timer_data.mutex = &file_mutex;
-  pthread_t timer;
-  pthread_create(&(timer), NULL, &th_timer, (void *)&timer_data);
+  int pooled = !served && reactor_threads == 0;
+  if (pooled && (stop_event_open() == -1 ||
+                 pool_start(workers, max_connections) == -1))
+    exit(-1);
 
-  while (!terminated) {
-    struct sockaddr_storage conn_addr;
-    int connfd = wait_for_connection(socketfd, &conn_addr);
-    if (connfd == -1)
+  while (pooled && !terminated) {
+    int slot = pool_acquire_slot();
+    if (slot == -1)
       exit(-1);
-    else if (connfd == 0)
+    else if (slot == 0)
       continue;
 
-    tl_entry_t *listener = (tl_entry_t *)malloc(sizeof(tl_entry_t));
-
-    listener->tdata.connfd = connfd;
-    listener->tdata.conn_addr = conn_addr;
-    listener->tdata.done = 0;
-    listener->tdata.mutex = &file_mutex;
-
-    pthread_create(&(listener->thread), NULL, &th_listen, (void *)&(listener->tdata));
-    SLIST_INSERT_HEAD(&tl_list, listener, list);
-
-    tl_entry_t * entry = SLIST_FIRST(&tl_list);
-    while (entry != NULL && entry->tdata.done) {
-      SLIST_REMOVE_HEAD(&tl_list, list);
-      pthread_join(entry->thread, NULL);
-      free(entry);
-      entry = SLIST_FIRST(&tl_list);
-    }
-    while (entry != NULL) {
-      tl_entry_t * next = SLIST_NEXT(entry, list);
-      while (next != NULL && next->tdata.done) {
-        SLIST_REMOVE(&tl_list, next, tl_entry, list);
-        pthread_join(next->thread, NULL);
-        free(next);
-        next = SLIST_NEXT(entry, list);
-      }
-      entry = next;
+    thread_data_t data;
+    data.connfd = wait_for_connection(socketfd, &data.conn_addr);
+    if (data.connfd == -1)
+      exit(-1);
+    else if (data.connfd == 0) {
+      pool_release_slot();
+      timestamp_tick(&timestamp);
+      continue;
     }
+    pool_submit(&data);
   }
 
   syslog(LOG_INFO, "Caught signal, exiting");
 
-  pthread_kill(timer, SIGINT);
-  pthread_join(timer, NULL);
+  if (pooled) {
+    pool_stop();
+    stop_event_close();
+  }
+
+  timestamp_close();
+
+  if (target.batched) writer_stop(&writer);
+  target_close(&target);
 
   #ifndef USE_AESD_CHAR_DEVICE
   remove(targetFile);
@@ -0,0 +1,65 @@
+/*
+ * aesdsocket_frame.h
+ *
+ * Binary framing of the aesdsocket protocol. A connection switches to it by
+ * sending the line "AESDSOCKET_MODE:binary\n"; everything after that line is
+ * frames in both directions. Each frame is a struct aesd_frame_header
+ * followed by length bytes of payload. All fields are in network byte order.
+ *
+ * Requests and their replies, which carry the sequence of the request:
+ *   APPEND  payload appended to the target as is, newlines or not. With
+ *           /dev/aesdchar it must end with a newline, else ERROR EINVAL:
+ *           the device would join a partial line to the next write of any
+ *           connection.
+ *           ACK with the offset just past the appended payload, or with the
+ *           target size for an empty payload. Appends of other connections
+ *           may follow it already. ERROR when the payload was not appended.
+ *   SEEK    struct aesd_frame_seek, as the AESDCHAR_IOCSEEKTO ioctl.
+ *           ACK with the resulting offset, or ERROR.
+ *   READ    1 to AESD_FRAME_MAX_READS struct aesd_frame_read.
+ *           One DATA frame per range in order, holding the bytes of the
+ *           range that exist, the last one flagged AESD_FRAME_FLAG_LAST.
+ * A request with an unknown type or a malformed payload gets an ERROR with an
+ * errno value. A header with a bad magic or a payload longer than
+ * AESD_FRAME_MAX_PAYLOAD closes the connection.
+ */
+
+#ifndef AESDSOCKET_FRAME_H
+#define AESDSOCKET_FRAME_H
+
+#include <stdint.h>
+
+#define AESD_FRAME_MAGIC 0xAE5D
+#define AESD_FRAME_MAX_PAYLOAD (1024 * 1024)
+#define AESD_FRAME_MAX_READS 32
+
+enum aesd_frame_type {
+  AESD_FRAME_APPEND = 1,
+  AESD_FRAME_SEEK = 2,
+  AESD_FRAME_READ = 3,
+  AESD_FRAME_ACK = 0x81,    // payload: uint64_t offset
+  AESD_FRAME_DATA = 0x82,   // payload: target bytes
+  AESD_FRAME_ERROR = 0x83,  // payload: uint32_t errno value
+};
+
+#define AESD_FRAME_FLAG_LAST 1
+
+struct aesd_frame_header {
+  uint16_t magic;
+  uint8_t type;
+  uint8_t flags;
+  uint32_t length;    // payload bytes following the header
+  uint32_t sequence;  // chosen by the client, echoed in replies
+};
+
+struct aesd_frame_seek {
+  uint32_t write_cmd;
+  uint32_t write_cmd_offset;
+};
+
+struct aesd_frame_read {
+  uint64_t offset;
+  uint64_t length;
+};
+
+#endif /* AESDSOCKET_FRAME_H */